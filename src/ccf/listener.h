@@ -25,6 +25,10 @@
 //#include "log/mlogger.h"
 #include <iostream>
 
+#ifndef CCF_LISTENER_ACCEPT_LIMIT
+#define CCF_LISTENER_ACCEPT_LIMIT 64
+#endif
+
 namespace ccf {
 
 
@@ -55,31 +59,32 @@ listener<IMPL>::~listener() { }
 template <typename IMPL>
 void listener<IMPL>::read_event()
 try {
-	sockaddr_storage addr;
-	socklen_t addrlen = sizeof(addr);
-
-	int nfd = ::accept(fd(), (struct sockaddr*)&addr, &addrlen);
-	if(nfd <= 0) {
-		if(nfd < 0) {
-			if(errno == EAGAIN || errno == EINTR) {
-				return;
+	// bounded so that a connection storm doesn't starve other handlers
+	for(int i=0; i < CCF_LISTENER_ACCEPT_LIMIT; ++i) {
+		sockaddr_storage addr;
+		socklen_t addrlen = sizeof(addr);
+
+		int nfd = util::accept(fd(), (struct sockaddr*)&addr, &addrlen);
+		if(nfd <= 0) {
+			if(nfd < 0) {
+				if(errno == EAGAIN || errno == EINTR) {
+					return;
+				} else {
+					static_cast<IMPL*>(this)->closed();
+					throw mp::system_error(errno, "socket closed");
+				}
 			} else {
 				static_cast<IMPL*>(this)->closed();
 				throw mp::system_error(errno, "socket closed");
 			}
-		} else {
-			static_cast<IMPL*>(this)->closed();
-			throw mp::system_error(errno, "socket closed");
 		}
-	}
 
-	util::fd_setup(nfd);
-
-	try {
-		static_cast<IMPL*>(this)->accepted(nfd, (struct sockaddr*)&addr, addrlen);
-	} catch(...) {
-		::close(nfd);
-		throw;
+		try {
+			static_cast<IMPL*>(this)->accepted(nfd, (struct sockaddr*)&addr, addrlen);
+		} catch(...) {
+			::close(nfd);
+			throw;
+		}
 	}
 
 } catch(std::exception& e) {
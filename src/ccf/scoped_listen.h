@@ -19,6 +19,7 @@
 #define CCF_SCOPED_LISTEN_H__
 
 #include "ccf/address.h"
+#include "ccf/util.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -32,18 +33,18 @@ namespace ccf {
 
 class scoped_listen {
 public:
-	scoped_listen(const address& addr) :
+	scoped_listen(const address& addr, int defer_accept_sec = 0) :
 		m_addr(addr),
-		m_sock(listen(m_addr)) { }
+		m_sock(listen(m_addr, defer_accept_sec)) { }
 
-	scoped_listen(struct sockaddr_in addr) :
+	scoped_listen(struct sockaddr_in addr, int defer_accept_sec = 0) :
 		m_addr(addr),
-		m_sock(listen(m_addr)) { }
+		m_sock(listen(m_addr, defer_accept_sec)) { }
 
 #ifdef CCF_IPV6
-	scoped_listen(struct sockaddr_in6 addr) :
+	scoped_listen(struct sockaddr_in6 addr, int defer_accept_sec = 0) :
 		m_addr(addr),
-		m_sock(listen(m_addr)) { }
+		m_sock(listen(m_addr, defer_accept_sec)) { }
 #endif
 
 	~scoped_listen()
@@ -52,7 +53,7 @@ public:
 	}
 
 public:
-	static int listen(const address& addr)
+	static int listen(const address& addr, int defer_accept_sec = 0)
 	{
 		int lsock = socket(PF_INET, SOCK_STREAM, 0);
 		if(lsock < 0) {
@@ -78,6 +79,7 @@ public:
 			throw mp::system_error(errno, "listen failed");
 		}
 	
+		util::listen_setup(lsock, defer_accept_sec);
 		mp::set_nonblock(lsock);
 	
 		return lsock;
@@ -17,6 +17,8 @@
 //
 #include "ccf/service.h"
 #include <mp/pthread.h>
+#include <stdexcept>
+#include <fstream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -41,10 +43,15 @@ static void signal_handler(void*, int signo)
 }
 
 void init()
+{
+	init(0, 0);
+}
+
+void init(size_t backlog_size, size_t task_queue_limit)
 {
 	//event.reset(new mp::wavy::core());
 	//net.reset(new mp::wavy::net());
-	wavy::init(0, 0);
+	wavy::init(0, 0, backlog_size, task_queue_limit);
 
 	sigset_t ss;
 	sigemptyset(&ss);
@@ -96,6 +103,69 @@ void start(size_t rthreads, size_t wthreads)
 	wavy::add_wthread(wthreads);
 }
 
+void start(size_t rthreads, size_t wthreads,
+		const std::vector<int>& rcpus, const std::vector<int>& wcpus)
+{
+	// pinned workers allocate their buffers on the local node
+	// by the kernel's first-touch policy.
+	wavy::add_rthread(rthreads, rcpus);
+	wavy::add_wthread(wthreads, wcpus);
+}
+
+static void parse_cpu_range(const std::string& item, std::vector<int>* result)
+{
+	const char* p = item.c_str();
+	char* end;
+
+	long first = strtol(p, &end, 10);
+	if(end == p) {
+		throw std::runtime_error("invalid cpu list: " + item);
+	}
+
+	long last = first;
+	if(*end == '-') {
+		p = end + 1;
+		last = strtol(p, &end, 10);
+		if(end == p) {
+			throw std::runtime_error("invalid cpu list: " + item);
+		}
+	}
+
+	if(*end != '\0' || first < 0 || last < first) {
+		throw std::runtime_error("invalid cpu list: " + item);
+	}
+
+	for(long i=first; i <= last; ++i) {
+		result->push_back(i);
+	}
+}
+
+std::vector<int> parse_cpus(const std::string& list)
+{
+	std::vector<int> result;
+	std::string::size_type pos = 0;
+	while(pos < list.size()) {
+		std::string::size_type next = list.find(',', pos);
+		if(next == std::string::npos) { next = list.size(); }
+		std::string item = list.substr(pos, next - pos);
+		pos = next + 1;
+
+		if(item.compare(0, 4, "node") == 0) {
+			std::string path = "/sys/devices/system/node/" + item + "/cpulist";
+			std::ifstream f(path.c_str());
+			std::string nodelist;
+			if(!std::getline(f, nodelist)) {
+				throw std::runtime_error("unknown NUMA node: " + item);
+			}
+			std::vector<int> cpus = parse_cpus(nodelist);
+			result.insert(result.end(), cpus.begin(), cpus.end());
+		} else {
+			parse_cpu_range(item, &result);
+		}
+	}
+	return result;
+}
+
 void join()
 {
 	//event->join();
@@ -19,6 +19,8 @@
 #define CCF_SERVICE_H__
 
 #include "ccf/wavy.h"
+#include <string>
+#include <vector>
 
 namespace ccf {
 namespace service {
@@ -26,10 +28,22 @@ namespace service {
 
 void init();
 
+// 0 selects the compile-time default
+void init(size_t backlog_size, size_t task_queue_limit);
+
 void daemonize(const char* pidfile = NULL, const char* stdio = "/dev/null");
 
 void start(size_t rthreads, size_t wthreads);
 
+// pins read/write workers to the cpus round-robin.
+// an empty list leaves the workers unpinned.
+void start(size_t rthreads, size_t wthreads,
+		const std::vector<int>& rcpus, const std::vector<int>& wcpus);
+
+// parses a cpu list such as "0-3,8,10-11".
+// "nodeN" expands to the cpus of NUMA node N.
+std::vector<int> parse_cpus(const std::string& list);
+
 void join();
 
 void stop();
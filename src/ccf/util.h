@@ -22,6 +22,8 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 namespace ccf {
 namespace util {
@@ -40,6 +42,38 @@ static inline void fd_setup(int fd)
 }
 
 
+// sockets accepted by accept() inherit the options set here.
+// if defer_accept_sec > 0, connections are not reported until
+// request bytes arrive (Linux only).
+static inline void listen_setup(int lsock, int defer_accept_sec = 0)
+{
+	fd_setup(lsock);
+#ifdef TCP_DEFER_ACCEPT
+	if(defer_accept_sec > 0) {
+		::setsockopt(lsock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+				&defer_accept_sec, sizeof(defer_accept_sec));  // ignore error
+	}
+#endif
+}
+
+
+// returns a non-blocking, close-on-exec socket.
+static inline int accept(int lsock, struct sockaddr* addr, socklen_t* addrlen)
+{
+#ifdef __linux__
+	return ::accept4(lsock, addr, addrlen, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+	int fd = ::accept(lsock, addr, addrlen);
+	if(fd > 0) {
+		::fcntl(fd, F_SETFD, FD_CLOEXEC);  // ignore error
+		::fcntl(fd, F_SETFL, O_NONBLOCK);  // ignore error
+		fd_setup(fd);
+	}
+	return fd;
+#endif
+}
+
+
 }  // namespace util
 }  // namespace ccf
 
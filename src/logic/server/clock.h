@@ -97,7 +97,7 @@ public:
 public:
 	uint64_t get() const { return m; }
 
-	uint32_t time() const { return m & 0xffffffff; }
+	uint32_t time() const { return m >> 32; }
 
 	Clock clock() const {
 		return Clock(m&0xffffffff);
@@ -0,0 +1,191 @@
+//
+// Kastor
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "server/config.h"
+#include <ccf/service.h>
+#include <stdexcept>
+#include <fstream>
+#include <stdlib.h>
+#include <unistd.h>
+
+// largest number of read or write threads
+#ifndef CONFIG_THREADS_MAX
+#define CONFIG_THREADS_MAX 1024
+#endif
+
+namespace kastor {
+
+
+config::config() :
+	port(3000),
+	defer_accept(0),
+	edge_backlog(0),
+	task_queue_limit(0),
+	http_reserve(0),
+	verify_get(false)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if(ncpu < 1) { ncpu = 1; }
+	rthreads = ncpu < 2 ? 2 : ncpu;
+	wthreads = ncpu < 4 ? 2 : ncpu / 2;
+}
+
+
+static std::string strip(const std::string& str)
+{
+	std::string::size_type begin = str.find_first_not_of(" \t\r\n");
+	if(begin == std::string::npos) { return std::string(); }
+	std::string::size_type end = str.find_last_not_of(" \t\r\n");
+	return str.substr(begin, end - begin + 1);
+}
+
+// accepts k, m and g suffixes
+static uint64_t parse_size(const std::string& key, const std::string& value)
+{
+	char* end;
+	unsigned long long n = strtoull(value.c_str(), &end, 10);
+	if(end == value.c_str()) {
+		throw std::runtime_error("invalid value of " + key + ": " + value);
+	}
+	switch(*end) {
+	case 'g': case 'G': n *= 1024;
+	case 'm': case 'M': n *= 1024;
+	case 'k': case 'K': n *= 1024;
+		++end;
+	}
+	if(*end != '\0') {
+		throw std::runtime_error("invalid value of " + key + ": " + value);
+	}
+	return n;
+}
+
+
+// plain decimal from 1 to max; sizes would be truncated
+static unsigned long parse_number(const std::string& key, const std::string& value,
+		unsigned long max)
+{
+	if(value.empty() || value.size() > 9 ||
+			value.find_first_not_of("0123456789") != std::string::npos) {
+		throw std::runtime_error("invalid value of " + key + ": " + value);
+	}
+	unsigned long n = strtoul(value.c_str(), NULL, 10);
+	if(n == 0 || n > max) {
+		throw std::runtime_error("invalid value of " + key + ": " + value);
+	}
+	return n;
+}
+
+
+void config::set(const std::string& key, const std::string& value)
+{
+	if(key == "storage") {
+		storage = value;
+	} else if(key == "port") {
+		port = parse_number(key, value, 65535);
+	} else if(key == "defer_accept") {
+		defer_accept = parse_size(key, value);
+	} else if(key == "rthreads") {
+		rthreads = parse_number(key, value, CONFIG_THREADS_MAX);
+	} else if(key == "wthreads") {
+		wthreads = parse_number(key, value, CONFIG_THREADS_MAX);
+	} else if(key == "rcpus") {
+		rcpus = ccf::service::parse_cpus(value);
+	} else if(key == "wcpus") {
+		wcpus = ccf::service::parse_cpus(value);
+	} else if(key == "edge_backlog") {
+		edge_backlog = parse_size(key, value);
+	} else if(key == "task_queue_limit") {
+		task_queue_limit = parse_size(key, value);
+	} else if(key == "http_reserve") {
+		http_reserve = parse_size(key, value);
+	} else if(key == "verify_get") {
+		verify_get = parse_size(key, value) != 0;
+	} else if(key == "inline_size") {
+		storage_option.inline_size = parse_size(key, value);
+	} else if(key == "chunk_size") {
+		uint64_t n = parse_size(key, value);
+		if(n == 0 || n > 0xffffffffLLU) {
+			throw std::runtime_error("invalid value of chunk_size: " + value);
+		}
+		storage_option.chunk_size = n;
+	} else if(key == "cache_size") {
+		storage_option.cache_size = parse_size(key, value);
+	} else if(key == "cache_object_max") {
+		storage_option.cache_object_max = parse_size(key, value);
+	} else if(key == "scrub_rate") {
+		storage_option.scrub_rate = parse_size(key, value);
+	} else if(key == "vector_dir") {
+		// once per vector file
+		storage_option.vector_dirs.push_back(value);
+	} else if(key == "key_index") {
+		storage_option.key_index = parse_size(key, value) != 0;
+	} else if(key == "hot_keys_interval") {
+		storage_option.hot_keys_interval = parse_size(key, value);
+	} else if(key == "warmup") {
+		storage_option.warmup_threads = parse_size(key, value);
+	} else if(key == "warmup_index") {
+		storage_option.warmup_index_bytes = parse_size(key, value);
+	} else if(key == "vec_expand") {
+		storage_option.expand_size = parse_size(key, value);
+	} else if(key == "recover") {
+		storage_option.recover_threads = parse_size(key, value);
+	} else if(key == "durability") {
+		if(value == "none") {
+			storage_option.durability = ostorage::SYNC_NONE;
+		} else if(value == "data") {
+			storage_option.durability = ostorage::SYNC_DATA;
+		} else if(value == "full") {
+			storage_option.durability = ostorage::SYNC_FULL;
+		} else {
+			throw std::runtime_error("invalid value of durability: " + value);
+		}
+	} else {
+		throw std::runtime_error("unknown config key: " + key);
+	}
+}
+
+void config::set(const std::string& pair)
+{
+	std::string::size_type pos = pair.find('=');
+	if(pos == std::string::npos) {
+		throw std::runtime_error("invalid config: " + pair);
+	}
+	set(strip(pair.substr(0, pos)), strip(pair.substr(pos+1)));
+}
+
+void config::load(const std::string& path)
+{
+	std::ifstream f(path.c_str());
+	if(!f) {
+		throw std::runtime_error("can't open config file: " + path);
+	}
+
+	std::string line;
+	while(std::getline(f, line)) {
+		std::string::size_type comment = line.find('#');
+		if(comment != std::string::npos) {
+			line.erase(comment);
+		}
+		line = strip(line);
+		if(line.empty()) { continue; }
+		set(line);
+	}
+}
+
+
+}  // namespace kastor
+
@@ -0,0 +1,64 @@
+//
+// Kastor
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef CONFIG_H__
+#define CONFIG_H__
+
+#include "server/ostorage.h"
+#include <string>
+#include <vector>
+
+namespace kastor {
+
+
+struct config {
+	config();
+
+	// reads "key = value" lines. '#' starts a comment.
+	void load(const std::string& path);
+
+	// throws std::runtime_error if the key or the value is invalid.
+	void set(const std::string& key, const std::string& value);
+
+	// "key=value"
+	void set(const std::string& pair);
+
+	std::string storage;
+	unsigned short port;
+	int defer_accept;
+
+	size_t rthreads;
+	size_t wthreads;
+	std::vector<int> rcpus;
+	std::vector<int> wcpus;
+
+	// 0 selects the compile-time default
+	size_t edge_backlog;
+	size_t task_queue_limit;
+	size_t http_reserve;
+
+	// verify the body checksum on GET
+	bool verify_get;
+
+	ostorage::option storage_option;
+};
+
+
+}  // namespace kastor
+
+#endif /* config.h */
+
@@ -0,0 +1,230 @@
+//
+// Kastor
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "server/crc32c.h"
+#if defined(__x86_64__)
+#include <cpuid.h>
+#define CRC32C_SSE42
+#endif
+
+// bytes per stream when three streams are interleaved
+#ifndef CRC32C_LONG
+#define CRC32C_LONG 8192
+#endif
+
+#ifndef CRC32C_SHORT
+#define CRC32C_SHORT 256
+#endif
+
+namespace kastor {
+
+
+namespace {
+	static const uint32_t POLY = 0x82f63b78;
+
+	struct crc32c_table {
+		uint32_t t[256];
+
+		crc32c_table()
+		{
+			for(uint32_t i=0; i < 256; ++i) {
+				uint32_t c = i;
+				for(int k=0; k < 8; ++k) {
+					c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+				}
+				t[i] = c;
+			}
+		}
+	};
+
+	static const crc32c_table s_table;
+
+	static uint32_t crc32c_sw(uint32_t crc, const void* buf, size_t len)
+	{
+		const unsigned char* p = (const unsigned char*)buf;
+		uint32_t c = ~crc;
+		while(len--) {
+			c = s_table.t[(c ^ *p++) & 0xff] ^ (c >> 8);
+		}
+		return ~c;
+	}
+
+#ifdef CRC32C_SSE42
+	// multiplies the 32x32 matrix over GF(2) by vec
+	static uint32_t gf2_times(const uint32_t* mat, uint32_t vec)
+	{
+		uint32_t sum = 0;
+		while(vec) {
+			if(vec & 1) { sum ^= *mat; }
+			vec >>= 1;
+			++mat;
+		}
+		return sum;
+	}
+
+	static void gf2_square(uint32_t* square, const uint32_t* mat)
+	{
+		for(int n=0; n < 32; ++n) {
+			square[n] = gf2_times(mat, mat[n]);
+		}
+	}
+
+	// tables that append len zero bytes to a crc.
+	// the crcs of the interleaved streams are combined with them.
+	struct crc32c_shift_table {
+		uint32_t t[4][256];
+
+		crc32c_shift_table(size_t len)
+		{
+			uint32_t even[32];
+			uint32_t odd[32];
+
+			// one zero bit
+			odd[0] = POLY;
+			uint32_t row = 1;
+			for(int n=1; n < 32; ++n) {
+				odd[n] = row;
+				row <<= 1;
+			}
+			gf2_square(even, odd);  // two bits
+			gf2_square(odd, even);  // four bits
+
+			// len is a power of two
+			const uint32_t* op = odd;
+			for(;;) {
+				gf2_square(even, odd);
+				op = even;
+				len >>= 1;
+				if(len == 0) { break; }
+				gf2_square(odd, even);
+				op = odd;
+				len >>= 1;
+				if(len == 0) { break; }
+			}
+
+			for(uint32_t n=0; n < 256; ++n) {
+				t[0][n] = gf2_times(op, n);
+				t[1][n] = gf2_times(op, n << 8);
+				t[2][n] = gf2_times(op, n << 16);
+				t[3][n] = gf2_times(op, n << 24);
+			}
+		}
+
+		uint32_t shift(uint32_t crc) const
+		{
+			return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff] ^
+				t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+		}
+	};
+
+	static const crc32c_shift_table s_long(CRC32C_LONG);
+	static const crc32c_shift_table s_short(CRC32C_SHORT);
+
+	static inline uint32_t crc32b(uint32_t c, unsigned char v)
+	{
+		__asm__("crc32b %1, %0" : "+r"(c) : "rm"(v));
+		return c;
+	}
+
+	static inline uint64_t crc32q(uint64_t c, uint64_t v)
+	{
+		__asm__("crc32q %1, %0" : "+r"(c) : "rm"(v));
+		return c;
+	}
+
+	// crc32 has a latency of three cycles and a throughput of one,
+	// so three streams are computed at once and shifted together
+	static uint32_t crc32c_hw(uint32_t crc, const void* buf, size_t len)
+	{
+		const unsigned char* p = (const unsigned char*)buf;
+		uint64_t c0 = ~crc;
+
+		while(len > 0 && ((uintptr_t)p & 7) != 0) {
+			c0 = crc32b(c0, *p++);
+			--len;
+		}
+
+		while(len >= CRC32C_LONG*3) {
+			uint64_t c1 = 0;
+			uint64_t c2 = 0;
+			const unsigned char* end = p + CRC32C_LONG;
+			do {
+				c0 = crc32q(c0, *(const uint64_t*)p);
+				c1 = crc32q(c1, *(const uint64_t*)(p + CRC32C_LONG));
+				c2 = crc32q(c2, *(const uint64_t*)(p + CRC32C_LONG*2));
+				p += 8;
+			} while(p < end);
+			c0 = s_long.shift(c0) ^ c1;
+			c0 = s_long.shift(c0) ^ c2;
+			p += CRC32C_LONG*2;
+			len -= CRC32C_LONG*3;
+		}
+
+		while(len >= CRC32C_SHORT*3) {
+			uint64_t c1 = 0;
+			uint64_t c2 = 0;
+			const unsigned char* end = p + CRC32C_SHORT;
+			do {
+				c0 = crc32q(c0, *(const uint64_t*)p);
+				c1 = crc32q(c1, *(const uint64_t*)(p + CRC32C_SHORT));
+				c2 = crc32q(c2, *(const uint64_t*)(p + CRC32C_SHORT*2));
+				p += 8;
+			} while(p < end);
+			c0 = s_short.shift(c0) ^ c1;
+			c0 = s_short.shift(c0) ^ c2;
+			p += CRC32C_SHORT*2;
+			len -= CRC32C_SHORT*3;
+		}
+
+		while(len >= 8) {
+			c0 = crc32q(c0, *(const uint64_t*)p);
+			p += 8;
+			len -= 8;
+		}
+
+		while(len > 0) {
+			c0 = crc32b(c0, *p++);
+			--len;
+		}
+
+		return ~(uint32_t)c0;
+	}
+
+	static bool has_sse42()
+	{
+		unsigned int eax, ebx, ecx, edx;
+		if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) { return false; }
+		return (ecx & bit_SSE4_2) != 0;
+	}
+
+	static uint32_t (* const s_crc32c)(uint32_t, const void*, size_t) =
+		has_sse42() ? crc32c_hw : crc32c_sw;
+#else
+	static uint32_t (* const s_crc32c)(uint32_t, const void*, size_t) =
+		crc32c_sw;
+#endif
+}  // noname namespace
+
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len)
+{
+	return s_crc32c(crc, buf, len);
+}
+
+
+}  // namespace kastor
+
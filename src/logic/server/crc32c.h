@@ -0,0 +1,35 @@
+//
+// Kastor
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef CRC32C_H__
+#define CRC32C_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace kastor {
+
+
+// CRC-32C (Castagnoli).
+// crc is the value returned for the preceding bytes, or 0.
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
+
+}  // namespace kastor
+
+#endif /* crc32c.h */
+
@@ -20,7 +20,7 @@
 
 #include "server/types.h"
 #include <ccf/service.h>
-#include <mp/stream_buffer.h>
+#include "server/recv_buffer.h"
 #include <map>
 #include <string>
 
@@ -29,14 +29,16 @@ namespace kastor {
 
 class handler_stream {
 public:
-	handler_stream(int fd, mp::stream_buffer& buffer);
+	// reserve_size is the read-ahead of the next request
+	handler_stream(int fd, recv_buffer& buffer, size_t reserve_size);
 	~handler_stream();
 
 	ssize_t read(void* buf, size_t count);
 
 private:
 	int m_fd;
-	mp::stream_buffer& m_buffer;
+	recv_buffer& m_buffer;
+	size_t m_reserve_size;
 
 	handler_stream();
 };
@@ -55,17 +57,26 @@ public:
 
 	typedef std::map<std::string, std::string> headers_t;
 
+	// bytes reserved in the receive buffer before each read.
+	// 0 selects the compile-time default.
+	static void set_reserve_size(size_t size);
+
 	//void process_get(const char* path, size_t pathlen, headers_t& h);
 
 	//void process_put(const char* path, size_t pathlen, headers_t& h,
 	//		size_t content_length);
 
+	//void process_post(const char* path, size_t pathlen, headers_t& h,
+	//		size_t content_length);
+
 	//void process_data(handler_stream s, size_t* content_length);
 
 private:
-	mp::stream_buffer m_buffer;
+	recv_buffer m_buffer;
 	size_t m_content_length;
 
+	static size_t s_reserve_size;
+
 private:
 	http_handler();
 	http_handler(const http_handler&);
@@ -19,6 +19,7 @@
 #define HTTP_HANDLER_H_IMPL__
 
 #include <mp/exception.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <iostream>
 
@@ -26,29 +27,64 @@
 #define HTTP_RESERVE_SIZE 1024
 #endif
 
+// body reads shorter than this also read ahead into the receive buffer
+#ifndef HTTP_READV_THRESHOLD
+#define HTTP_READV_THRESHOLD 64*1024
+#endif
+
 namespace kastor {
 
 
-inline handler_stream::handler_stream(int fd, mp::stream_buffer& buffer) :
-	m_fd(fd), m_buffer(buffer) { }
+inline handler_stream::handler_stream(int fd, recv_buffer& buffer,
+		size_t reserve_size) :
+	m_fd(fd), m_buffer(buffer), m_reserve_size(reserve_size) { }
 
 inline handler_stream::~handler_stream() { }
 
 inline ssize_t handler_stream::read(void* buf, size_t count)
 {
-	size_t sz = m_buffer.data_size();
+	size_t sz = std::min(m_buffer.data_size(), count);
 	if(sz > 0) {
-		sz = std::min(sz, count);
 		memcpy(buf, m_buffer.data(), sz);
 		m_buffer.data_used(sz);
-		return sz;
-	} else {
-		// FIXME readv() if count < X
-		return ::read(m_fd, buf, count);
+		if(sz == count) { return sz; }
+	}
+
+	// the tail of a body is read together with the head of
+	// the next request
+	struct iovec vec[2];
+	vec[0].iov_base = (char*)buf + sz;
+	vec[0].iov_len = count - sz;
+	int veclen = 1;
+	if(vec[0].iov_len < HTTP_READV_THRESHOLD) {
+		m_buffer.reserve_buffer(m_reserve_size);
+		vec[1].iov_base = m_buffer.buffer();
+		vec[1].iov_len = m_buffer.buffer_capacity();
+		veclen = 2;
+	}
+
+	ssize_t rl = ::readv(m_fd, vec, veclen);
+	if(rl <= 0) {
+		return sz > 0 ? (ssize_t)sz : rl;
 	}
+
+	if((size_t)rl > vec[0].iov_len) {
+		m_buffer.buffer_consumed(rl - vec[0].iov_len);
+		return count;
+	}
+	return sz + rl;
 }
 
 
+template <typename IMPL>
+size_t http_handler<IMPL>::s_reserve_size = HTTP_RESERVE_SIZE;
+
+template <typename IMPL>
+void http_handler<IMPL>::set_reserve_size(size_t size)
+{
+	s_reserve_size = size ? size : HTTP_RESERVE_SIZE;
+}
+
 template <typename IMPL>
 http_handler<IMPL>::http_handler(int fd) :
 	mp::wavy::handler(fd), m_content_length(0) { }
@@ -61,32 +97,47 @@ template <typename IMPL>
 void http_handler<IMPL>::read_event()
 try {
 	if(m_content_length > 0) {
+		// may read ahead the next request into m_buffer
 		static_cast<IMPL*>(this)->process_data(
-				handler_stream(fd(), m_buffer), &m_content_length);
-		return;
-	}
-
-	m_buffer.reserve_buffer(HTTP_RESERVE_SIZE);
+				handler_stream(fd(), m_buffer, s_reserve_size), &m_content_length);
 
-	size_t rl = ::read(fd(), m_buffer.buffer(), m_buffer.buffer_capacity());
-	if(rl <= 0) {
-		if(rl == 0) {
-			throw mp::system_error(errno, "connection closed");
-		}
-		if(errno == EAGAIN || errno == EINTR) {
-			return;
-		} else {
-			throw mp::system_error(errno, "read error");
+	} else {
+		m_buffer.reserve_buffer(s_reserve_size);
+
+		ssize_t rl = ::read(fd(), m_buffer.buffer(), m_buffer.buffer_capacity());
+		if(rl <= 0) {
+			if(rl == 0) {
+				throw mp::system_error(errno, "connection closed");
+			}
+			if(errno == EAGAIN || errno == EINTR) {
+				m_buffer.recycle();
+				return;
+			} else {
+				throw mp::system_error(errno, "read error");
+			}
 		}
-	}
 
-	m_buffer.buffer_consumed(rl);
+		m_buffer.buffer_consumed(rl);
+	}
 
 	//std::cout << "read" << std::endl;
 	//std::cout.write((const char*)m_buffer.data(), m_buffer.data_size());
 	//std::cout << std::endl;
 
-	static_cast<IMPL*>(this)->process_header();
+	// the read may carry a request body or pipelined requests
+	while(m_buffer.data_size() > 0) {
+		if(m_content_length > 0) {
+			static_cast<IMPL*>(this)->process_data(
+					handler_stream(fd(), m_buffer, s_reserve_size), &m_content_length);
+		} else {
+			size_t before = m_buffer.data_size();
+			static_cast<IMPL*>(this)->process_header();
+			if(m_buffer.data_size() == before) { break; }  // incomplete
+		}
+	}
+
+	// keep-alive connections hold no buffer between requests
+	m_buffer.recycle();
 
 } catch(std::exception& e) {
 	//FIXME LOG_ERROR("listener: ", e.what());
@@ -138,7 +189,9 @@ void http_handler<IMPL>::process_header()
 	char* posbody = memmem(h+14, m_buffer.data_size()-14, "\r\n\r\n", 4);
 	if(!posbody) { return; }
 
-	char* path = h + 4;
+	char* path = (char*)memchr(h, ' ', posbody-h);
+	if(!path) { throw std::runtime_error("invalid request"); }
+	++path;
 
 	char* pathend = memmem(path, posbody-path, " HTTP/", 6);
 	if(!pathend) { throw std::runtime_error("invalid request"); }
@@ -150,7 +203,9 @@ void http_handler<IMPL>::process_header()
 		headers_t h;
 		static_cast<IMPL*>(this)->process_get(path, pathend-path, h);
 
-	} else if(strncasecmp(h, "PUT", 3) == 0) {
+	} else if(strncasecmp(h, "PUT", 3) == 0 || strncasecmp(h, "POST", 4) == 0) {
+		bool put = h[1] == 'U' || h[1] == 'u';
+
 		char* clen = strncasestr(pathend, posbody-pathend, "Content-Length: ");
 		if(!clen) { throw std::runtime_error("invalid request"); }
 
@@ -159,7 +214,11 @@ void http_handler<IMPL>::process_header()
 		m_buffer.data_used(posbody - h + 4);
 
 		headers_t h;
-		static_cast<IMPL*>(this)->process_put(path, pathend-path, h, m_content_length);
+		if(put) {
+			static_cast<IMPL*>(this)->process_put(path, pathend-path, h, m_content_length);
+		} else {
+			static_cast<IMPL*>(this)->process_post(path, pathend-path, h, m_content_length);
+		}
 
 	} else {
 		std::cout << h << std::endl;
@@ -16,47 +16,80 @@
 //    limitations under the License.
 //
 #include "server/framework.h"
+#include "server/ostorage_http.h"
+#include "server/config.h"
 #include <ccf/scoped_listen.h>
 #include <ccf/service.h>
+#include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 void usage(const char* prog)
 {
-	printf("usage: %s <storage> [port=3000]\n", prog);
+	printf("usage: %s [options] <storage> [port=3000]\n", prog);
+	printf("  -c <file>       read configuration from the file\n");
+	printf("  -o <key=value>  set a configuration value\n");
+	printf("  -r <num>        number of read threads\n");
+	printf("  -w <num>        number of write threads\n");
+	printf("  -R <num>        rebuild the index with the threads and exit\n");
 	exit(1);
 }
 
 int main(int argc, char* argv[])
 {
-	if(argc <= 1 || argc > 3) { usage(argv[0]); }
-	const char* path = argv[1];
+	using namespace kastor;
+
+	config conf;
+	bool rebuild_only = false;
+
+	try {
+		int opt;
+		while((opt = getopt(argc, argv, "c:o:r:w:R:h")) != -1) {
+			switch(opt) {
+			case 'c': conf.load(optarg); break;
+			case 'o': conf.set(optarg); break;
+			case 'r': conf.set("rthreads", optarg); break;
+			case 'w': conf.set("wthreads", optarg); break;
+			case 'R': conf.set("recover", optarg); rebuild_only = true; break;
+			default: usage(argv[0]);
+			}
+		}
 
-	if(path[0] == '-') { usage(argv[0]); }
+		if(argc - optind > 2) { usage(argv[0]); }
+		if(optind < argc) { conf.set("storage", argv[optind]); }
+		if(optind + 1 < argc) { conf.set("port", argv[optind+1]); }
 
-	unsigned short port = 3000;
-	
-	if(argc == 3) {
-		port = atoi(argv[2]);
-		if(port == 0) { usage(argv[0]); }
+	} catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		usage(argv[0]);
 	}
 
-	mkdir(path, 0777);
+	if(conf.storage.empty()) { usage(argv[0]); }
 
-	using namespace kastor;
+	mkdir(conf.storage.c_str(), 0777);
+
+	if(rebuild_only) {
+		ostorage storage(conf.storage, conf.storage_option);
+		return 0;
+	}
 
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	addr.sin_port = htons(port);
+	addr.sin_port = htons(conf.port);
 
-	ccf::service::init();
+	ccf::service::init(conf.edge_backlog, conf.task_queue_limit);
 
-	ccf::scoped_listen lsock(addr);
-	ostorage storage(path);
+	// the port is opened after the storage is warm; connections are
+	// refused until then
+	ostorage storage(conf.storage, conf.storage_option);
+	ccf::scoped_listen lsock(addr, conf.defer_accept);
+	ostorage_http::set_reserve_size(conf.http_reserve);
+	ostorage_http::set_verify_get(conf.verify_get);
 	framework::init(storage, lsock.sock());
 
-	ccf::service::start(3, 3);
+	ccf::service::start(conf.rthreads, conf.wthreads, conf.rcpus, conf.wcpus);
 	ccf::service::join();
 }
 
@@ -0,0 +1,257 @@
+//
+// Kastor
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "server/object_cache.h"
+#include <algorithm>
+#include <new>
+#include <stdlib.h>
+
+// bytes per sketch column; the sketch is sized for capacity / this
+#ifndef OBJECT_CACHE_SKETCH_UNIT
+#define OBJECT_CACHE_SKETCH_UNIT 4096
+#endif
+
+namespace kastor {
+
+
+object_cache::lru::lru() :
+	head(NULL), tail(NULL), bytes(0) { }
+
+void object_cache::lru::push(body* b)
+{
+	b->m_prev = NULL;
+	b->m_next = head;
+	if(head) { head->m_prev = b; }
+	head = b;
+	if(!tail) { tail = b; }
+	bytes += b->m_size;
+}
+
+void object_cache::lru::unlink(body* b)
+{
+	if(b->m_prev) { b->m_prev->m_next = b->m_next; } else { head = b->m_next; }
+	if(b->m_next) { b->m_next->m_prev = b->m_prev; } else { tail = b->m_prev; }
+	b->m_prev = NULL;
+	b->m_next = NULL;
+	bytes -= b->m_size;
+}
+
+
+object_cache::sketch::sketch(size_t width) :
+	m_additions(0)
+{
+	size_t w = 1024;
+	while(w < width) { w <<= 1; }
+	m_table.resize(w * 4);
+	m_mask = w - 1;
+	m_sample = w * 10;
+}
+
+size_t object_cache::sketch::index(uint64_t id, int row) const
+{
+	static const uint64_t SEEDS[4] = {
+		0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+		0x165667b19e3779f9ULL, 0x27d4eb2f165667c5ULL,
+	};
+	uint64_t h = id + SEEDS[row];
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	h = h ^ (h >> 31);
+	return row * (m_mask + 1) + (h & m_mask);
+}
+
+void object_cache::sketch::increment(uint64_t id)
+{
+	bool added = false;
+	for(int row=0; row < 4; ++row) {
+		uint8_t& c = m_table[index(id, row)];
+		if(c < 15) {
+			++c;
+			added = true;
+		}
+	}
+	if(added && ++m_additions >= m_sample) {
+		reset();
+	}
+}
+
+unsigned int object_cache::sketch::estimate(uint64_t id) const
+{
+	unsigned int n = 15;
+	for(int row=0; row < 4; ++row) {
+		n = std::min(n, (unsigned int)m_table[index(id, row)]);
+	}
+	return n;
+}
+
+// ages the counts so that the past popularity fades
+void object_cache::sketch::reset()
+{
+	for(size_t i=0; i < m_table.size(); ++i) {
+		m_table[i] >>= 1;
+	}
+	m_additions /= 2;
+}
+
+
+object_cache::object_cache(size_t capacity, size_t object_max) :
+	m_object_max(std::min(object_max, capacity)),
+	m_window_max(capacity * OBJECT_CACHE_WINDOW / 100),
+	m_main_max(capacity - m_window_max),
+	m_protected_max(m_main_max * OBJECT_CACHE_PROTECTED / 100),
+	m_sketch(capacity / OBJECT_CACHE_SKETCH_UNIT) { }
+
+object_cache::~object_cache()
+{
+	for(map_t::iterator it(m_map.begin()), it_end(m_map.end());
+			it != it_end; ++it) {
+		release(it->second);
+	}
+}
+
+object_cache::body* object_cache::alloc(uint32_t size)
+{
+	body* b = (body*)::malloc(sizeof(body) + size);
+	if(!b) { throw std::bad_alloc(); }
+	b->m_prev = NULL;
+	b->m_next = NULL;
+	b->m_id = 0;
+	b->m_size = size;
+	b->m_region = NONE;
+	b->m_refcount = 1;
+	return b;
+}
+
+void object_cache::release(body* b)
+{
+	if(__sync_sub_and_fetch(&b->m_refcount, 1) == 0) {
+		::free(b);
+	}
+}
+
+object_cache::lru& object_cache::list_of(int region)
+{
+	switch(region) {
+	case WINDOW:    return m_window;
+	case PROBATION: return m_probation;
+	default:        return m_protected;
+	}
+}
+
+object_cache::body* object_cache::get(uint64_t id)
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	m_sketch.increment(id);
+
+	map_t::iterator it = m_map.find(id);
+	if(it == m_map.end()) { return NULL; }
+	body* b = it->second;
+
+	switch(b->m_region) {
+	case WINDOW:
+		m_window.unlink(b);
+		m_window.push(b);
+		break;
+
+	case PROBATION:
+		// second hit in the main space
+		m_probation.unlink(b);
+		m_protected.push(b);
+		b->m_region = PROTECTED;
+		while(m_protected.bytes > m_protected_max) {
+			body* t = m_protected.tail;
+			m_protected.unlink(t);
+			m_probation.push(t);
+			t->m_region = PROBATION;
+		}
+		break;
+
+	case PROTECTED:
+		m_protected.unlink(b);
+		m_protected.push(b);
+		break;
+	}
+
+	__sync_fetch_and_add(&b->m_refcount, 1);
+	return b;
+}
+
+void object_cache::put(uint64_t id, body* b)
+{
+	if(b->m_size > m_object_max) { return; }
+
+	mp::pthread_scoped_lock lk(m_mutex);
+
+	std::pair<map_t::iterator, bool> ins =
+		m_map.insert(map_t::value_type(id, b));
+	if(!ins.second) { return; }
+
+	__sync_fetch_and_add(&b->m_refcount, 1);
+	b->m_id = id;
+	b->m_region = WINDOW;
+	m_window.push(b);
+
+	while(m_window.bytes > m_window_max) {
+		body* c = m_window.tail;
+		m_window.unlink(c);
+		admit(c);
+	}
+}
+
+void object_cache::admit(body* c)
+{
+	if(c->m_size > m_main_max) {
+		evict(c);
+		return;
+	}
+
+	unsigned int freq = m_sketch.estimate(c->m_id);
+
+	while(m_probation.bytes + m_protected.bytes + c->m_size > m_main_max) {
+		body* v = m_probation.tail ? m_probation.tail : m_protected.tail;
+		if(freq <= m_sketch.estimate(v->m_id)) {
+			evict(c);
+			return;
+		}
+		list_of(v->m_region).unlink(v);
+		evict(v);
+	}
+
+	m_probation.push(c);
+	c->m_region = PROBATION;
+}
+
+void object_cache::evict(body* b)
+{
+	m_map.erase(b->m_id);
+	b->m_region = NONE;
+	release(b);
+}
+
+void object_cache::erase(uint64_t id)
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	map_t::iterator it = m_map.find(id);
+	if(it == m_map.end()) { return; }
+	body* b = it->second;
+	list_of(b->m_region).unlink(b);
+	evict(b);
+}
+
+
+}  // namespace kastor
+
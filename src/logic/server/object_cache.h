@@ -0,0 +1,148 @@
+//
+// Kastor
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef OBJECT_CACHE_H__
+#define OBJECT_CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mp/pthread.h>
+#include <tr1/unordered_map>
+#include <vector>
+
+// share of the capacity for the admission window, in percent
+#ifndef OBJECT_CACHE_WINDOW
+#define OBJECT_CACHE_WINDOW 1
+#endif
+
+// share of the main space for the protected segment, in percent
+#ifndef OBJECT_CACHE_PROTECTED
+#define OBJECT_CACHE_PROTECTED 80
+#endif
+
+namespace kastor {
+
+
+// Object bodies in memory up to a byte budget, keyed by an id that
+// is never reused for other contents.
+//
+// W-TinyLFU: new bodies enter a small LRU window. A body leaving the
+// window replaces the victim of the main segmented LRU only if a
+// count-min sketch estimates it was requested more often.
+class object_cache {
+public:
+	object_cache(size_t capacity, size_t object_max);
+	~object_cache();
+
+	class body {
+	public:
+		char* data() { return m_data; }
+		uint32_t size() const { return m_size; }
+
+	private:
+		body* m_prev;
+		body* m_next;
+		uint64_t m_id;
+		uint32_t m_size;
+		int m_region;
+		volatile unsigned int m_refcount;
+		char m_data[1];
+		friend class object_cache;
+	};
+
+	size_t object_max() const { return m_object_max; }
+
+	// returns a body referenced for the caller, or NULL.
+	// counts the request of id either way.
+	body* get(uint64_t id);
+
+	// a body to be filled and passed to put(), referenced for the caller
+	static body* alloc(uint32_t size);
+
+	// offers the body for id. the caller keeps its reference.
+	void put(uint64_t id, body* b);
+
+	void erase(uint64_t id);
+
+	static void release(body* b);
+
+private:
+	enum region_t {
+		NONE,
+		WINDOW,
+		PROBATION,
+		PROTECTED,
+	};
+
+	struct lru {
+		lru();
+		body* head;  // most recent
+		body* tail;
+		size_t bytes;
+		void push(body* b);
+		void unlink(body* b);
+	};
+
+	// 4-bit counters with halving
+	class sketch {
+	public:
+		sketch(size_t width);
+		void increment(uint64_t id);
+		unsigned int estimate(uint64_t id) const;
+
+	private:
+		std::vector<uint8_t> m_table;
+		size_t m_mask;
+		size_t m_additions;
+		size_t m_sample;
+
+		size_t index(uint64_t id, int row) const;
+		void reset();
+	};
+
+	void admit(body* candidate);
+	void evict(body* b);
+
+	lru& list_of(int region);
+
+private:
+	const size_t m_object_max;
+	const size_t m_window_max;
+	const size_t m_main_max;
+	const size_t m_protected_max;
+
+	mp::pthread_mutex m_mutex;
+
+	typedef std::tr1::unordered_map<uint64_t, body*> map_t;
+	map_t m_map;
+
+	lru m_window;
+	lru m_probation;
+	lru m_protected;
+
+	sketch m_sketch;
+
+private:
+	object_cache();
+	object_cache(const object_cache&);
+};
+
+
+}  // namespace kastor
+
+#endif /* object_cache.h */
+
@@ -16,91 +16,252 @@
 //    limitations under the License.
 //
 #include "ostorage.h"
+#include "crc32c.h"
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <iostream>
 
 #define VEC_HEADER_SIZE 4096
+#define VEC_MAGIC "KASTORV2"
 
+#ifndef OBJECT_CACHE_OBJECT_MAX
+#define OBJECT_CACHE_OBJECT_MAX (256*1024)
+#endif
+
+#ifndef OSTORAGE_CHUNK_SIZE
+#define OSTORAGE_CHUNK_SIZE (64*1024*1024)
+#endif
+
+#ifndef VEC_EXPAND_SIZE
 #define VEC_EXPAND_SIZE (2LLU*1024*1024*1024)
+#endif
+
+// multipart uploads in progress
+#ifndef UPLOAD_LIMIT
+#define UPLOAD_LIMIT 1024
+#endif
+
+// seconds an upload is kept after its last part
+#ifndef UPLOAD_EXPIRE
+#define UPLOAD_EXPIRE (24*60*60)
+#endif
+
+// keys looked up under one lock of the leases by read() of many keys
+#ifndef OSTORAGE_READ_BATCH
+#define OSTORAGE_READ_BATCH 32
+#endif
+
+// iovs passed to one pwritev()
+#ifdef IOV_MAX
+#define OSTORAGE_WRITEV_LIMIT ((size_t)IOV_MAX)
+#else
+#define OSTORAGE_WRITEV_LIMIT ((size_t)1024)
+#endif
 
 namespace kastor {
 
 
 // storage vector header = 4KB
-// magic, endian, used-size
-// +---+-------+-------+
-// + 8 |   6   |   8   |  ...
-// +---+-------+-------+
-// endian
-//     (padding)
-//             used size
+// magic, used-size, records-begin, closed, volume, seq
+// +-------+-------+-------+-------+-------+-------+
+// |   8   |   8   |   8   |   8   |   8   |   8   |  ...
+// +-------+-------+-------+-------+-------+-------+
+// magic
+//         used size
+//                 offset of the first record
+//                 (vectors written before records have their
+//                  blocks in front of it)
+//                         1 if used size was synced at close
+//                                 position in vector_dir
+//                                         seq of a recent record
+
+// vector record, padded to 8 bytes
+// +---+---+-------+---+---+---+---+---+-----+------+
+// | 4 | 4 |   8   | 4 | 4 | 2 | 2 | 4 | key | body |
+// +---+---+-------+---+---+---+---+---+-----+------+
+// magic
+//     crc32c of the header from clocktime and the key
+//         clocktime
+//                 body size
+//                     crc32c of the body
+//                         key length
+//                             flags: pending, committed or removed,
+//                                    and if the body crc is set
+//                                 seq; later writes have larger ones
+//                                 (modulo 2^32) across the vector files
 
 // index value
-// +---+---+-------+
-// | 4 | 4 |   8   |
-// +---+---+-------+
+// +---+---+-------+---+------+
+// | 4 | 4 |   8   | 4 | body |
+// +---+---+-------+---+------+
 // absolute time
 //     size
-//         offset
+//         offset; the vector file in the bits from 48
+//                 crc32c of the body; not stored if unknown
+//                     small bodies are kept here too
 // removed if offset == 0
+// the body is a chunk list if the top bit of offset is set
+
+// chunk list
+// +-------+---+---+---------------+---------------+
+// |   8   | 4 | 4 | chunk entries | ...
+// +-------+---+---+---------------+---------------+
+// size of the object
+//         number of the chunks
+//             (reserved)
+//
+// chunk entry
+// +-------+---+---+
+// |   8   | 4 | 4 |
+// +-------+---+---+
+// address of the chunk record body, as the index offset
+//         size
+//             crc32c
 
 
 inline ostorage::lease_entry::lease_entry(block* b, ClockTime ct) :
-	bk(b), clocktime(ct) { }
-
-
-ostorage::ostorage(const std::string& storage_dir)
+	bk(b), clocktime(ct), used(0) { }
+
+
+ostorage::option::option() :
+	expand_size(VEC_EXPAND_SIZE),
+	durability(SYNC_NONE),
+	recover_threads(0),
+	scrub_rate(0),
+	inline_size(INDEX_INLINE_SIZE),
+	cache_size(0),
+	cache_object_max(OBJECT_CACHE_OBJECT_MAX),
+	chunk_size(OSTORAGE_CHUNK_SIZE),
+	key_index(false),
+	hot_keys_interval(0),
+	warmup_threads(0),
+	warmup_index_bytes(0) { }
+
+
+ostorage::ostorage(const std::string& storage_dir, const option& opt) :
+	m_scrubber(NULL),
+	m_hot_keys_path(storage_dir + "/hot.keys"),
+	m_hot_keys_saver(NULL),
+	m_cache(NULL),
+	m_seq(0),
+	m_lease_tick(0),
+	m_key_map(NULL),
+	m_expand_size(opt.expand_size ? opt.expand_size : VEC_EXPAND_SIZE),
+	m_durability(opt.durability),
+	m_inline_size(std::min(opt.inline_size, (uint32_t)INDEX_INLINE_LIMIT)),
+	m_chunk_size(opt.chunk_size ? opt.chunk_size : OSTORAGE_CHUNK_SIZE)
 {
 	int err = 0;
 
-	std::string vec_path   = storage_dir + "/vector";
 	std::string index_path = storage_dir + "/index.tch";
+	std::string key_path   = storage_dir + "/keys.tcb";
 	//std::string free_path  = storage_dir + "/free.tch";
 
-	struct stat stbuf;
-
-	m_vec_fd = ::open(vec_path.c_str(), O_RDWR|O_CREAT, 0666);
-	if(m_vec_fd < 0) {
-		err = errno; goto out_storage;
-	}
-
-	// FIXME flock
-
-	if(fstat(m_vec_fd, &stbuf) < 0) {
-		err = errno; goto out_storage;
+	if(opt.vector_dirs.size() > (INDEX_CHUNKED >> VOLUME_SHIFT)) {
+		throw std::runtime_error("too many vector files");
 	}
 
-	m_vec_size = stbuf.st_size;
-	if(m_vec_size == 0) {
-		m_vec_size = VEC_HEADER_SIZE;
-		if(ftruncate(m_vec_fd, m_vec_size) < 0) {
-			err = errno; goto out_storage;
+	try {
+		if(opt.vector_dirs.empty()) {
+			m_volumes.push_back(open_volume(storage_dir, 0));
+		} else {
+			for(size_t i=0; i < opt.vector_dirs.size(); ++i) {
+				m_volumes.push_back(open_volume(opt.vector_dirs[i], i));
+			}
 		}
-	} else if(m_vec_size < VEC_HEADER_SIZE) {
-		err = errno; goto out_storage;  // FIXME
+	} catch (...) {
+		close_volumes(false);
+		throw;
 	}
 
-	m_header_map = ::mmap(NULL, VEC_HEADER_SIZE, PROT_READ|PROT_WRITE,
-			MAP_SHARED, m_vec_fd, 0);
-	if(m_header_map == MAP_FAILED) {
-		err = errno; goto out_header_mmap;
+	for(size_t i=0; i < m_volumes.size(); ++i) {
+		raise_seq(*m_volumes[i]->seq);
 	}
 
-	// FIXME check endiang
-	m_used = (volatile uint64_t*)(((char*)m_header_map) + 8);
-
 	m_index_map = tchdbnew();
 	if(!m_index_map) {
 		err = errno; goto out_index_map;
 	}
 
-	if(!tchdbopen(m_index_map, index_path.c_str(), HDBOWRITER|HDBOCREAT)) {
+	if(!tchdbopen(m_index_map, index_path.c_str(), HDBOWRITER|HDBOCREAT|
+				(opt.recover_threads ? HDBOTRUNC : 0))) {
 		err = errno; goto out_index_map_open;
 	}
 
+	try {
+		bool clean = true;
+		if(opt.recover_threads) {
+			rebuild_index(opt.recover_threads);
+			clean = false;
+		} else {
+			for(size_t i=0; i < m_volumes.size(); ++i) {
+				if(*m_volumes[i]->closed != 1) {
+					scan_tail(m_volumes[i]);
+					clean = false;
+				}
+			}
+		}
+		if(opt.key_index) {
+			// it isn't synced; rebuilt unless it was closed with the index
+			struct stat st;
+			bool fresh = ::stat(key_path.c_str(), &st) < 0;
+			m_key_map = tcbdbnew();
+			if(!m_key_map) { throw std::bad_alloc(); }
+			if(!tcbdbsetmutex(m_key_map) ||
+					!tcbdbopen(m_key_map, key_path.c_str(), BDBOWRITER|BDBOCREAT|
+						(clean ? 0 : BDBOTRUNC))) {
+				tcbdbdel(m_key_map);
+				m_key_map = NULL;
+				throw std::runtime_error("can't open key index");
+			}
+			if(fresh || !clean) {
+				rebuild_key_index();
+			}
+		} else {
+			// stale after updates without it
+			::unlink(key_path.c_str());
+		}
+		for(size_t i=0; i < m_volumes.size(); ++i) {
+			volume* v = m_volumes[i];
+			*v->closed = 0;
+			if(::msync(v->header_map, VEC_HEADER_SIZE, MS_SYNC) < 0) {
+				throw mp::system_error(errno, "msync");
+			}
+		}
+		if(opt.cache_size) {
+			m_cache = new object_cache(opt.cache_size, opt.cache_object_max);
+		}
+		if(opt.warmup_threads) {
+			warmup(index_path, opt.warmup_threads, opt.warmup_index_bytes);
+		}
+		if(opt.hot_keys_interval) {
+			start_hot_keys_saver(opt.hot_keys_interval);
+		}
+		if(opt.scrub_rate) {
+			start_scrubber(opt.scrub_rate);
+		}
+	} catch (...) {
+		stop_hot_keys_saver();
+		delete m_cache;
+		if(m_key_map) {
+			tcbdbclose(m_key_map);
+			tcbdbdel(m_key_map);
+		}
+		tchdbclose(m_index_map);
+		tchdbdel(m_index_map);
+		close_volumes(false);
+		throw;
+	}
+
 	/*
 	m_free_map = tchdbnew();
 	if(!m_free_map) {
@@ -128,17 +289,16 @@ out_index_map_open:
 	tchdbdel(m_index_map);
 
 out_index_map:
-	::munmap(m_header_map, VEC_HEADER_SIZE);
-
-out_header_mmap:
-	::close(m_vec_fd);
-
-out_storage:
+	close_volumes(false);
 	throw mp::system_error(err, "can't initialize storage");
 }
 
 ostorage::~ostorage()
 {
+	stop_scrubber();
+	stop_hot_keys_saver();
+	delete m_cache;
+
 	// close, munmap, ...
 	mp::pthread_scoped_lock lslk(m_leases_mutex);
 	for(leases_t::iterator it(m_leases.begin()),
@@ -153,10 +313,13 @@ ostorage::~ostorage()
 	tchdbclose(m_free_map);
 	tchdbdel(m_free_map);
 	*/
+	if(m_key_map) {
+		tcbdbclose(m_key_map);
+		tcbdbdel(m_key_map);
+	}
 	tchdbclose(m_index_map);
 	tchdbdel(m_index_map);
-	::munmap(m_header_map, VEC_HEADER_SIZE);
-	::close(m_vec_fd);
+	close_volumes(true);
 	/*
 	for(vec_map_t::iterator it(m_vec_map.begin()),
 			it_end(m_vec_map.end()); it != it_end; ++it) {
@@ -165,18 +328,217 @@ ostorage::~ostorage()
 	*/
 }
 
-void ostorage::expand_storage(vecoff_t req)
+ostorage::volume* ostorage::open_volume(const std::string& dir, uint32_t id)
 {
-	mp::pthread_mutex m_storage_mutex;
-	if(m_vec_size >= req) { return; }
+	int err = 0;
 
-	vecoff_t nsize = m_vec_size + VEC_EXPAND_SIZE;
-	while(nsize < req) { nsize += VEC_EXPAND_SIZE; }
+	std::string vec_path = dir + "/vector";
+
+	struct stat stbuf;
+	char* header;
 
-	if(ftruncate(m_vec_fd, nsize) < 0) {
+	volume* v = new volume();
+	v->id = id;
+	v->base = (vecoff_t)id << VOLUME_SHIFT;
+	v->writing = 0;
+
+	v->fd = ::open(vec_path.c_str(), O_RDWR|O_CREAT, 0666);
+	if(v->fd < 0) {
+		err = errno; goto out_open;
+	}
+
+	// FIXME flock
+
+	if(fstat(v->fd, &stbuf) < 0) {
+		err = errno; goto out_storage;
+	}
+
+	v->size = stbuf.st_size;
+	if(v->size == 0) {
+		v->size = VEC_HEADER_SIZE;
+		if(ftruncate(v->fd, v->size) < 0) {
+			err = errno; goto out_storage;
+		}
+	} else if(v->size < VEC_HEADER_SIZE) {
+		err = errno; goto out_storage;  // FIXME
+	}
+
+	v->header_map = ::mmap(NULL, VEC_HEADER_SIZE, PROT_READ|PROT_WRITE,
+			MAP_SHARED, v->fd, 0);
+	if(v->header_map == MAP_FAILED) {
+		err = errno; goto out_storage;
+	}
+	header = (char*)v->header_map;
+
+	// FIXME check endiang
+	v->used = (volatile uint64_t*)(header + 8);
+
+	if(memcmp(header, VEC_MAGIC, 8) != 0) {
+		// new vector, or blocks without records up to used
+		vecoff_t begin = *v->used;
+		if(begin < VEC_HEADER_SIZE) { begin = VEC_HEADER_SIZE; }
+		begin = (begin + 7) & ~(vecoff_t)7;
+		*v->used = begin;
+		*(uint64_t*)(header + 16) = begin;
+		*(uint64_t*)(header + 24) = 1;
+		*(uint64_t*)(header + 32) = id;
+		memcpy(header, VEC_MAGIC, 8);
+	}
+	v->records_begin = *(uint64_t*)(header + 16);
+	v->closed = (volatile uint64_t*)(header + 24);
+	v->seq = (volatile uint64_t*)(header + 40);
+
+	if(*(uint64_t*)(header + 32) != id) {
+		::munmap(v->header_map, VEC_HEADER_SIZE);
+		::close(v->fd);
+		delete v;
+		throw std::runtime_error(vec_path + " belongs to another position of vector_dir");
+	}
+
+	update_avail(v);
+
+	return v;
+
+out_storage:
+	::close(v->fd);
+
+out_open:
+	delete v;
+	throw mp::system_error(err, "can't open " + vec_path);
+}
+
+void ostorage::close_volumes(bool clean)
+{
+	for(size_t i=0; i < m_volumes.size(); ++i) {
+		volume* v = m_volumes[i];
+		if(clean && ::msync(v->header_map, VEC_HEADER_SIZE, MS_SYNC) == 0) {
+			*v->closed = 1;
+			::msync(v->header_map, VEC_HEADER_SIZE, MS_SYNC);
+		}
+		::munmap(v->header_map, VEC_HEADER_SIZE);
+		::close(v->fd);
+		delete v;
+	}
+	m_volumes.clear();
+}
+
+ostorage::volume* ostorage::volume_of(vecoff_t addr) const
+{
+	size_t id = (addr & ~INDEX_CHUNKED) >> VOLUME_SHIFT;
+	if(id >= m_volumes.size()) { return NULL; }
+	return m_volumes[id];
+}
+
+int ostorage::fd_of(vecoff_t addr) const
+{
+	volume* v = volume_of(addr);
+	if(!v) {
+		throw std::runtime_error("offset out of the vector files");
+	}
+	return v->fd;
+}
+
+void ostorage::update_avail(volume* v)
+{
+	struct statvfs st;
+	if(fstatvfs(v->fd, &st) < 0) {
+		throw mp::system_error(errno, "fstatvfs");
+	}
+	v->avail_used = *v->used;
+	v->avail = (uint64_t)st.f_bavail * st.f_frsize;
+}
+
+// the file with the fewest bodies being written for its free space.
+// free space counts the bytes allocated since it was read, as the
+// files grow sparse.
+ostorage::volume* ostorage::select_volume(vecoff_t rsize)
+{
+	if(m_volumes.size() == 1) { return m_volumes[0]; }
+
+	volume* best = NULL;
+	bool best_fits = false;
+	double best_score = 0;
+	for(std::vector<volume*>::iterator it(m_volumes.begin()),
+			it_end(m_volumes.end()); it != it_end; ++it) {
+		volume* v = *it;
+		vecoff_t used = *v->used;
+		vecoff_t avail_used = v->avail_used;
+		uint64_t avail = v->avail;
+		uint64_t written = used > avail_used ? used - avail_used : 0;
+		uint64_t free = avail > written ? avail - written : 0;
+
+		bool fits = free >= rsize;
+		double score = (v->writing + 1) / (double)(free + 1);
+		if(!best || (fits && !best_fits) ||
+				(fits == best_fits && score < best_score)) {
+			best = v;
+			best_fits = fits;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+void ostorage::raise_seq(uint32_t seq)
+{
+	if((int32_t)(seq - m_seq) > 0) {
+		m_seq = seq;
+	}
+}
+
+void ostorage::end_write(block* bk)
+{
+	if(bk->m_writing) {
+		bk->m_writing = false;
+		__sync_sub_and_fetch(&bk->m_vol->writing, 1);
+	}
+}
+
+void ostorage::expand_storage(volume* v, vecoff_t req)
+{
+	mp::pthread_scoped_lock stlk(v->mutex);
+	if(v->size >= req) { return; }
+
+	if(req > VOLUME_OFFSET_MASK) {
+		throw std::runtime_error("vector file is full");
+	}
+
+	vecoff_t nsize = v->size + m_expand_size;
+	while(nsize < req) { nsize += m_expand_size; }
+	if(nsize > VOLUME_OFFSET_MASK) { nsize = VOLUME_OFFSET_MASK; }
+
+	if(ftruncate(v->fd, nsize) < 0) {
 		throw mp::system_error(errno, "ftruncate");
 	}
-	m_vec_size = nsize;
+	v->size = nsize;
+
+	update_avail(v);
+}
+
+void ostorage::sync_block(block* bk)
+{
+	sync_range(bk->m_vol, bk->offset() - bk->m_head, bk->m_head + bk->size());
+}
+
+// the whole file; sync_file_range() neither flushes the write cache of
+// the disk nor the size set by expand_storage()
+void ostorage::sync_range(volume* vol, vecoff_t off, vecoff_t len)
+{
+	if(fdatasync(vol->fd) < 0) {
+		throw mp::system_error(errno, "fdatasync");
+	}
+}
+
+void ostorage::sync_index()
+{
+	for(size_t i=0; i < m_volumes.size(); ++i) {
+		if(::msync(m_volumes[i]->header_map, VEC_HEADER_SIZE, MS_SYNC) < 0) {
+			throw mp::system_error(errno, "msync");
+		}
+	}
+	if(!tchdbsync(m_index_map)) {
+		throw std::runtime_error("can't sync index");
+	}
 }
 
 void ostorage::add_free_pool(vecoff_t off, uint32_t size)
@@ -185,36 +547,134 @@ void ostorage::add_free_pool(vecoff_t off, uint32_t size)
 }
 
 
-ostorage::block* ostorage::balloc(uint32_t size)
+ostorage::vecoff_t ostorage::record_size(size_t keylen, uint32_t size)
+{
+	return (sizeof(record_header) + keylen + size + 7) & ~(vecoff_t)7;
+}
+
+static uint32_t record_hcrc(const void* h, size_t hlen, const char* key, size_t keylen)
+{
+	// magic and hcrc are not covered
+	return crc32c(crc32c(0, ((const char*)h) + 8, hlen - 8), key, keylen);
+}
+
+bool ostorage::record_valid(const record_header& h, const char* key)
+{
+	return h.magic == RECORD_MAGIC &&
+		h.hcrc == record_hcrc(&h, sizeof(h), key, h.keylen);
+}
+
+void ostorage::fill_record(volume* vol, record_header* h, const std::string& key,
+		uint32_t size, ClockTime ct, int flags, uint32_t bcrc)
+{
+	memset(h, 0, sizeof(*h));
+	h->magic = RECORD_MAGIC;
+	h->clocktime = ct.get();
+	h->size = size;
+	h->bcrc = bcrc;
+	h->keylen = key.size();
+	h->flags = flags;
+	h->seq = __sync_add_and_fetch(&m_seq, 1);
+	h->hcrc = record_hcrc(h, sizeof(*h), key.data(), key.size());
+	*vol->seq = h->seq;
+}
+
+void ostorage::write_record(volume* vol, vecoff_t rec, const std::string& key,
+		uint32_t size, ClockTime ct, int flags, uint32_t bcrc,
+		const char* body)
+{
+	record_header h;
+	fill_record(vol, &h, key, size, ct, flags, bcrc);
+
+	struct iovec vec[3];
+	vec[0].iov_base = &h;
+	vec[0].iov_len = sizeof(h);
+	vec[1].iov_base = const_cast<char*>(key.data());
+	vec[1].iov_len = key.size();
+	vec[2].iov_base = const_cast<char*>(body);
+	vec[2].iov_len = body ? size : 0;
+
+	ssize_t wl = ::pwritev(vol->fd, vec, body ? 3 : 2, rec);
+	if(wl != (ssize_t)(sizeof(h) + key.size() + vec[2].iov_len)) {
+		throw mp::system_error(wl < 0 ? errno : EIO, "can't write record header");
+	}
+}
+
+
+ostorage::block* ostorage::balloc(const std::string& key, uint32_t size)
+{
+	// small bodies are written with their record at update()
+	return balloc(key, size, size <= m_inline_size);
+}
+
+ostorage::block* ostorage::balloc_chunk(const std::string& key, uint32_t size)
+{
+	return balloc(key, size, false);
+}
+
+ostorage::block* ostorage::balloc(const std::string& key, uint32_t size, bool inl)
 {
-	block* bk = (block*)::malloc(sizeof(block));
+	if(key.size() > 0xffff) {
+		throw std::runtime_error("key too long");
+	}
+
+	block* bk = (block*)::malloc(sizeof(block) + (inl ? size : 0));
 	if(!bk) {
 		throw std::bad_alloc();
 	}
 
-	vecoff_t off = __sync_fetch_and_add(m_used, size);
-	if(m_vec_size < off+size) try {
-		expand_storage(off+size);
+	uint32_t head = sizeof(record_header) + key.size();
+	vecoff_t rsize = record_size(key.size(), size);
+
+	volume* v = select_volume(rsize);
+	vecoff_t rec = __sync_fetch_and_add(v->used, rsize);
+	try {
+		if(v->size < rec+rsize) {
+			expand_storage(v, rec+rsize);
+		}
+		// keeps the records walkable if the body never completes
+		if(!inl) {
+			write_record(v, rec, key, size, ClockTime(), RECORD_PENDING);
+		}
 	} catch (...) {
 		::free(bk);
 		throw;
 	}
 
+	init_block(bk, v, rec + head, head, size, inl);
+
+	if(!inl) {
+		bk->m_writing = true;
+		__sync_fetch_and_add(&v->writing, 1);
+	}
+
+	return bk;
+}
+
+void ostorage::init_block(block* bk, volume* vol, vecoff_t off,
+		uint32_t head, uint32_t size, bool inl)
+{
 	bk->m_size = size;
+	bk->m_head = head;
+	bk->m_crc  = 0;
+	bk->m_has_crc = false;
+	bk->m_data = inl ? (char*)(bk + 1) : NULL;
+	bk->m_chunked = false;
+	bk->m_writing = false;
 	bk->m_off  = off;
+	bk->m_vol  = vol;
 	bk->m_self = this;
 	bk->m_refcount = 1;
 	bk->is_free_block = true;
-
-	return bk;
 }
 
 void ostorage::bfree_real(block* bk)
 {
 	if(__sync_sub_and_fetch(&bk->m_refcount, 1) == 0) {
+		end_write(bk);
 		if(bk->is_free_block) {
 			uint32_t size = bk->size();
-			vecoff_t off = bk->offset();
+			vecoff_t off = bk->address();
 			::free(bk);
 
 			add_free_pool(off, size);
@@ -225,13 +685,60 @@ void ostorage::bfree_real(block* bk)
 	}
 }
 
+// false if the vector ends before len bytes
+static bool pread_all(int fd, char* buf, size_t len, ostorage::vecoff_t off)
+{
+	while(len > 0) {
+		ssize_t rl = ::pread(fd, buf, len, off);
+		if(rl <= 0) {
+			if(rl < 0 && errno == EINTR) { continue; }
+			if(rl == 0) { return false; }
+			throw mp::system_error(errno, "can't read vector");
+		}
+		buf += rl;
+		off += rl;
+		len -= rl;
+	}
+	return true;
+}
+
 ostorage::block* ostorage::read(std::string key)
 {
 	mp::pthread_scoped_lock lslk(m_leases_mutex);
+	return read_lease(key);
+}
+
+void ostorage::read(const std::vector<std::string>& keys, std::vector<block*>* result)
+{
+	result->assign(keys.size(), NULL);
+
+	// the lock is released between the batches so that other
+	// requests don't wait for all of the keys
+	try {
+		for(size_t i=0; i < keys.size(); ) {
+			mp::pthread_scoped_lock lslk(m_leases_mutex);
+			size_t end = std::min(i + OSTORAGE_READ_BATCH, keys.size());
+			for(; i < end; ++i) {
+				(*result)[i] = read_lease(keys[i]);
+			}
+		}
+	} catch (...) {
+		for(size_t i=0; i < keys.size(); ++i) {
+			if((*result)[i]) { bfree_real((*result)[i]); }
+		}
+		result->clear();
+		throw;
+	}
+}
+
+// m_leases_mutex must be locked
+ostorage::block* ostorage::read_lease(const std::string& key)
+{
 	leases_t::iterator it = m_leases.find(key);
 	if(it != m_leases.end()) {
 		block* bk = it->second.bk;
 		if(bk) {
+			it->second.used = ++m_lease_tick;
 			__sync_fetch_and_add(&bk->m_refcount, 1);
 			return bk;
 		} else {
@@ -251,24 +758,63 @@ ostorage::block* ostorage::read(std::string key)
 	uint32_t time = *(uint32_t*)mem;                   // FIXME endian
 	uint32_t size = *(uint32_t*)(((char*)mem) + 4);    // FIXME endian
 	vecoff_t off  = *(vecoff_t*)(((char*)mem) + 8);    // FIXME endian
-
-	::free(mem);
+	bool has_crc  = memlen >= INDEX_VALUE_SIZE;
+	uint32_t crc  = has_crc ? *(uint32_t*)(((char*)mem) + 16) : 0;  // FIXME endian
+	bool inl      = has_crc && (size_t)memlen == INDEX_VALUE_SIZE + size;
+	bool chunked  = (off & INDEX_CHUNKED) != 0;
+	volume* vol   = volume_of(off);
+	if(!vol) {
+		::free(mem);
+		throw std::runtime_error("index refers to a missing vector file");
+	}
+	off = offset_of(off);
 
 	// FIXME invalid clock
 	std::pair<leases_t::iterator, bool> ins = m_leases.insert(
 			leases_t::value_type(key, lease_entry(NULL, ClockTime(Clock(), time))) );
 
-	if(!ins.second) { return NULL; }
+	if(!ins.second) {
+		::free(mem);
+		return NULL;
+	}
 
-	block* bk = (block*)::malloc(sizeof(block));
+	// chunk lists are always in memory
+	block* bk = (block*)::malloc(sizeof(block) + ((inl || chunked) ? size : 0));
 	if(!bk) {
+		::free(mem);
 		m_leases.erase(ins.first);
 		throw std::bad_alloc();
 	}
+
+	bk->m_data = NULL;
+	if(inl) {
+		bk->m_data = (char*)(bk + 1);
+		memcpy(bk->m_data, ((char*)mem) + INDEX_VALUE_SIZE, size);
+	} else if(chunked) {
+		bk->m_data = (char*)(bk + 1);
+		try {
+			if(!pread_all(vol->fd, bk->m_data, size, off)) {
+				throw std::runtime_error("chunk list is out of the vector");
+			}
+		} catch (...) {
+			::free(bk);
+			::free(mem);
+			m_leases.erase(ins.first);
+			throw;
+		}
+	}
+	::free(mem);
 	ins.first->second.bk = bk;
+	ins.first->second.used = ++m_lease_tick;
 
 	bk->m_size = size;
+	bk->m_head = 0;
+	bk->m_crc  = crc;
+	bk->m_has_crc = has_crc;
+	bk->m_chunked = chunked;
+	bk->m_writing = false;
 	bk->m_off  = off;
+	bk->m_vol  = vol;
 	bk->m_self = this;
 	bk->m_refcount = 2;  // lease_entry + return
 	bk->is_free_block = false;
@@ -277,9 +823,47 @@ ostorage::block* ostorage::read(std::string key)
 }
 
 
+object_cache::body* ostorage::read_body(block* bk, bool* corrupt)
+{
+	*corrupt = false;
+	if(!m_cache || bk->data() || bk->size() > m_cache->object_max()) {
+		return NULL;
+	}
+
+	// offsets are not reused, so a cached body is never stale
+	object_cache::body* b = m_cache->get(bk->address());
+	if(b) { return b; }
+
+	b = object_cache::alloc(bk->size());
+	try {
+		if(!pread_all(bk->fd(), b->data(), bk->size(), bk->offset())) {
+			object_cache::release(b);
+			return NULL;
+		}
+	} catch (...) {
+		object_cache::release(b);
+		throw;
+	}
+
+	if(bk->has_crc() && crc32c(0, b->data(), bk->size()) != bk->crc()) {
+		object_cache::release(b);
+		*corrupt = true;
+		return NULL;
+	}
+
+	m_cache->put(bk->address(), b);
+	return b;
+}
+
+
 namespace {
 	typedef ostorage::vecoff_t vecoff_t;
 
+	struct index_value {
+		char mem[INDEX_VALUE_SIZE + INDEX_INLINE_LIMIT];
+		int len;  // 16 without the body crc
+	};
+
 	static inline void update_casproc_set_ignored(char* mem)
 	{
 		*(uint32_t*)mem = 0;
@@ -309,9 +893,10 @@ namespace {
 	
 	static void* update_casproc(const void* vbuf, int vsiz, int* sp, void* op)
 	{
-		char* mem = (char*)op;
+		index_value* v = (index_value*)op;
+		char* mem = v->mem;
 	
-		if(vsiz == 16) {
+		if(vsiz >= 16) {
 			uint32_t time = *(uint32_t*)vbuf;    // FIXME endian
 			uint32_t castime = *(uint32_t*)mem;  // FIXME endian
 			if(castime < time) {      // FIXME time compare
@@ -320,14 +905,15 @@ namespace {
 			}
 		}
 	
-		char* buf = (char*)malloc(16);
+		char* buf = (char*)malloc(v->len);
 		if(!buf) {
 			update_casproc_set_ignored(mem);
 			return NULL;
 		}
-		memcpy(buf, mem, 16);
+		memcpy(buf, mem, v->len);
+		*sp = v->len;
 	
-		if(vsiz == 16) {
+		if(vsiz >= 16) {
 			update_casproc_set_swapped(mem, (const char*)vbuf);
 		} else {
 			update_casproc_unset_swapped(mem);
@@ -339,12 +925,77 @@ namespace {
 
 bool ostorage::update(std::string key, block* bk, ClockTime ct)
 {
-	char mem[16];
-	*(uint32_t*)mem                = ct.time();     // FIXME endian
-	*(uint32_t*)(((char*)mem) + 4) = bk->size();    // FIXME endian
-	*(vecoff_t*)(((char*)mem) + 8) = bk->offset();  // FIXME endian
+	if(bk->m_data) {
+		// the record and the body in one write
+		if(!bk->has_crc()) {
+			bk->set_crc(crc32c(0, bk->m_data, bk->size()));
+		}
+		write_record(bk->m_vol, bk->offset() - bk->m_head, key, bk->size(), ct,
+				RECORD_COMMITTED | RECORD_BCRC |
+				(bk->m_chunked ? RECORD_MANIFEST : 0), bk->crc(), bk->m_data);
+		if(m_durability != SYNC_NONE) {
+			sync_block(bk);
+		}
+	} else {
+		if(m_durability == SYNC_DATA) {
+			// the body must reach the disk before the record is committed
+			sync_block(bk);
+		}
+		write_record(bk->m_vol, bk->offset() - bk->m_head, key, bk->size(), ct,
+				RECORD_COMMITTED | (bk->has_crc() ? RECORD_BCRC : 0), bk->crc());
+		if(m_durability == SYNC_FULL) {
+			// body and record before the index refers to them
+			sync_block(bk);
+		}
+		end_write(bk);
+	}
+	if(!update_lease(key, bk, ct)) {
+		return false;
+	}
+	if(m_durability == SYNC_FULL) {
+		sync_index();
+	}
+	return true;
+}
 
+bool ostorage::update_lease(const std::string& key, block* bk, ClockTime ct)
+{
 	mp::pthread_scoped_lock lslk(m_leases_mutex);
+	return update_lease_locked(key, bk, ct);
+}
+
+// m_leases_mutex must be locked
+bool ostorage::update_lease_locked(const std::string& key, block* bk, ClockTime ct)
+{
+	vecoff_t swapped;
+	uint32_t swapped_size;
+	if(!put_index_locked(key, bk, ct, &swapped, &swapped_size)) {
+		return false;
+	}
+	apply_lease_locked(key, bk, ct, swapped, swapped_size);
+	return true;
+}
+
+// m_leases_mutex must be locked
+bool ostorage::put_index_locked(const std::string& key, block* bk, ClockTime ct,
+		vecoff_t* swapped, uint32_t* swapped_size)
+{
+	*swapped = 0;
+	*swapped_size = 0;
+
+	index_value v;
+	char* mem = v.mem;
+	*(uint32_t*)mem                 = ct.time();     // FIXME endian
+	*(uint32_t*)(((char*)mem) + 4)  = bk->size();    // FIXME endian
+	*(vecoff_t*)(((char*)mem) + 8)  = bk->address() |
+		(bk->m_chunked ? INDEX_CHUNKED : 0);         // FIXME endian
+	*(uint32_t*)(((char*)mem) + 16) = bk->crc();     // FIXME endian
+	v.len = bk->has_crc() ? INDEX_VALUE_SIZE : 16;
+	if(bk->m_data && bk->size() <= m_inline_size) {
+		memcpy(mem + INDEX_VALUE_SIZE, bk->m_data, bk->size());
+		v.len += bk->size();
+	}
+
 	leases_t::iterator it = m_leases.find(key);
 	if(it != m_leases.end()) {
 		if(ct < it->second.clocktime) {
@@ -355,28 +1006,17 @@ bool ostorage::update(std::string key, block* bk, ClockTime ct)
 		// time is checked
 		if(!tchdbput(m_index_map,
 				key.data(), key.size(),
-				mem, sizeof(mem))) {
+				mem, v.len)) {
 			return false;  // FIXME exception?
 		}
 
-		if(it->second.bk) {
-			it->second.bk->is_free_block = true;
-			bfree_real(it->second.bk);
-		}
-
-		__sync_fetch_and_add(&bk->m_refcount, 1);
-		it->second.bk = bk;
-		it->second.clocktime = ct;
-
-		bk->is_free_block = false;
-
 		return true;
 
 	} else {
 		if(!tchdbputproc(m_index_map,
 				key.data(), key.size(),
-				mem, sizeof(mem),
-				update_casproc, (void*)mem)) {
+				mem, v.len,
+				update_casproc, (void*)&v)) {
 			return false;  // FIXME exception?
 		}
 
@@ -385,30 +1025,73 @@ bool ostorage::update(std::string key, block* bk, ClockTime ct)
 		}
 
 		if(update_casproc_is_swapped(mem)) {
-			uint32_t size = *(uint32_t*)(mem + 4);
-			vecoff_t off  = *(vecoff_t*)(mem + 8);
-			add_free_pool(off, size);
+			*swapped_size = *(uint32_t*)(mem + 4);
+			*swapped      = *(vecoff_t*)(mem + 8);
 		}
 
-		bk->is_free_block = false;
+		return true;
+	}
+}
 
-		std::pair<leases_t::iterator, bool> ins = m_leases.insert(
-				leases_t::value_type(key, lease_entry(bk, ct)) );
-		if(!ins.second) { return false; }  // FIXME
+// m_leases_mutex must be locked
+void ostorage::apply_lease_locked(const std::string& key, block* bk, ClockTime ct,
+		vecoff_t swapped, uint32_t swapped_size)
+{
+	if(swapped) {
+		if(m_cache) { m_cache->erase(swapped); }
+		add_free_pool(swapped, swapped_size);
+	}
 
-		__sync_fetch_and_add(&bk->m_refcount, 1);
+	if(m_key_map) {
+		// fails if the key is there already
+		tcbdbputkeep(m_key_map, key.data(), key.size(), "", 0);
+	}
 
-		return true;
+	// the lease is looked up again; a batch may put a key twice
+	leases_t::iterator it = m_leases.find(key);
+	if(it != m_leases.end()) {
+		if(it->second.bk) {
+			it->second.bk->is_free_block = true;
+			if(m_cache) { m_cache->erase(it->second.bk->address()); }
+			bfree_real(it->second.bk);
+		}
+		it->second.bk = bk;
+		it->second.clocktime = ct;
+	} else {
+		m_leases.insert(leases_t::value_type(key, lease_entry(bk, ct)));
 	}
+
+	__sync_fetch_and_add(&bk->m_refcount, 1);
+	bk->is_free_block = false;
 }
 
 
 bool ostorage::remove(std::string key, ClockTime ct)
 {
-	char mem[16];
+	// tombstone, so that rebuilding the index doesn't revive the key
+	scoped_block bk(balloc(key, 0));
+	write_record(bk->m_vol, bk->offset() - bk->m_head, key, 0, ct, RECORD_REMOVED);
+	if(m_durability == SYNC_FULL) {
+		sync_block(bk.get());
+	}
+
+	if(!remove_lease(key, ct)) {
+		return false;
+	}
+	if(m_durability == SYNC_FULL) {
+		sync_index();
+	}
+	return true;
+}
+
+bool ostorage::remove_lease(const std::string& key, ClockTime ct)
+{
+	index_value v;
+	char* mem = v.mem;
 	*(uint32_t*)mem                = ct.time();        // FIXME endian
 	*(uint32_t*)(((char*)mem) + 4) = 0;
-	*(vecoff_t*)(((char*)mem) + 4) = 0;
+	*(vecoff_t*)(((char*)mem) + 8) = 0;
+	v.len = 16;
 
 	mp::pthread_scoped_lock lslk(m_leases_mutex);
 	leases_t::iterator it = m_leases.find(key);
@@ -421,11 +1104,16 @@ bool ostorage::remove(std::string key, ClockTime ct)
 		if(it->second.bk) {
 			if(!tchdbput(m_index_map,
 					key.data(), key.size(),
-					mem, sizeof(mem))) {
+					mem, v.len)) {
 				return false;  // FIXME exception?
 			}
 
 			it->second.bk->is_free_block = true;
+			if(m_cache) { m_cache->erase(it->second.bk->address()); }
+
+			if(m_key_map) {
+				tcbdbout(m_key_map, key.data(), key.size());
+			}
 		}
 		it->second.clocktime = ct;
 
@@ -434,8 +1122,8 @@ bool ostorage::remove(std::string key, ClockTime ct)
 	} else {
 		if(!tchdbputproc(m_index_map,
 				key.data(), key.size(),
-				mem, sizeof(mem),
-				update_casproc, (void*)mem)) {
+				mem, v.len,
+				update_casproc, (void*)&v)) {
 			return false;  // FIXME exception?
 		}
 
@@ -446,9 +1134,14 @@ bool ostorage::remove(std::string key, ClockTime ct)
 		if(update_casproc_is_swapped(mem)) {
 			uint32_t size = *(uint32_t*)(mem + 4);
 			vecoff_t off  = *(vecoff_t*)(mem + 8);
+			if(m_cache) { m_cache->erase(off); }
 			add_free_pool(off, size);
 		}
 
+		if(m_key_map) {
+			tcbdbout(m_key_map, key.data(), key.size());
+		}
+
 		std::pair<leases_t::iterator, bool> ins = m_leases.insert(
 				leases_t::value_type(key, lease_entry(NULL, ct)) );
 		if(!ins.second) { return false; }  // FIXME
@@ -457,6 +1150,340 @@ bool ostorage::remove(std::string key, ClockTime ct)
 	}
 }
 
+bool ostorage::list(const std::string& prefix, const std::string& after,
+		size_t limit, std::vector<std::string>* result)
+{
+	if(!m_key_map) {
+		throw std::runtime_error("key index is disabled");
+	}
 
-}  // namespace kastor
+	// the B+tree is locked by itself; point lookups don't wait for it
+	BDBCUR* cur = tcbdbcurnew(m_key_map);
+	if(!cur) { throw std::bad_alloc(); }
+
+	bool more = false;
+	try {
+		const std::string& from(after < prefix ? prefix : after);
+		size_t n = 0;
+		bool found = tcbdbcurjump(cur, from.data(), from.size());
+		while(found) {
+			int klen;
+			char* kbuf = (char*)tcbdbcurkey(cur, &klen);
+			if(!kbuf) { break; }
+			std::string key(kbuf, klen);
+			::free(kbuf);
+
+			if(key.compare(0, prefix.size(), prefix) != 0) { break; }
+			if(key != after) {
+				if(n == limit) {
+					more = true;
+					break;
+				}
+				result->push_back(key);
+				++n;
+			}
+			found = tcbdbcurnext(cur);
+		}
+	} catch (...) {
+		tcbdbcurdel(cur);
+		throw;
+	}
 
+	tcbdbcurdel(cur);
+	return more;
+}
+
+
+ostorage::chunk ostorage::commit_chunk(const std::string& key, block* bk)
+{
+	if(!bk->has_crc()) {
+		throw std::runtime_error("chunk without checksum");
+	}
+
+	if(m_durability == SYNC_DATA) {
+		sync_block(bk);
+	}
+	write_record(bk->m_vol, bk->offset() - bk->m_head, key, bk->size(), ClockTime(),
+			RECORD_COMMITTED | RECORD_BCRC | RECORD_CHUNK, bk->crc());
+	if(m_durability == SYNC_FULL) {
+		sync_block(bk);
+	}
+	end_write(bk);
+
+	// referred by the chunk list
+	bk->is_free_block = false;
+
+	chunk c;
+	c.off  = bk->address();
+	c.size = bk->size();
+	c.crc  = bk->crc();
+	return c;
+}
+
+bool ostorage::update_chunks(const std::string& key, const chunks_t& chunks, ClockTime ct)
+{
+	uint64_t total = 0;
+	for(chunks_t::const_iterator it(chunks.begin()), it_end(chunks.end());
+			it != it_end; ++it) {
+		total += it->size;
+	}
+
+	size_t size = 16 + chunks.size() * 16;
+	if(size > 0xffffffffLU) {
+		throw std::runtime_error("too many chunks");
+	}
+
+	scoped_block bk(balloc(key, size, true));
+	char* p = bk->m_data;
+	*(uint64_t*)p       = total;          // FIXME endian
+	*(uint32_t*)(p + 8) = chunks.size();  // FIXME endian
+	*(uint32_t*)(p + 12) = 0;
+	p += 16;
+	for(chunks_t::const_iterator it(chunks.begin()), it_end(chunks.end());
+			it != it_end; ++it) {
+		*(vecoff_t*)p       = it->off;   // FIXME endian
+		*(uint32_t*)(p + 8)  = it->size;  // FIXME endian
+		*(uint32_t*)(p + 12) = it->crc;   // FIXME endian
+		p += 16;
+	}
+	bk->m_chunked = true;
+
+	return update(key, bk.get(), ct);
+}
+
+uint64_t ostorage::chunks_of(block* bk, chunks_t* result)
+{
+	const char* p = bk->m_data;
+	if(!bk->m_chunked || !p || bk->size() < 16) {
+		throw std::runtime_error("not a chunk list");
+	}
+
+	uint64_t total = *(uint64_t*)p;       // FIXME endian
+	uint32_t num   = *(uint32_t*)(p + 8);  // FIXME endian
+	if(bk->size() < 16 + (size_t)num * 16) {
+		throw std::runtime_error("broken chunk list");
+	}
+	p += 16;
+
+	result->resize(num);
+	for(uint32_t i=0; i < num; ++i) {
+		chunk& c((*result)[i]);
+		c.off  = *(vecoff_t*)p;        // FIXME endian
+		c.size = *(uint32_t*)(p + 8);   // FIXME endian
+		c.crc  = *(uint32_t*)(p + 12);  // FIXME endian
+		p += 16;
+	}
+	return total;
+}
+
+bool ostorage::add_part(const std::string& key, size_t part, const chunks_t& chunks)
+{
+	if(part >= UPLOAD_PART_LIMIT) { return false; }
+
+	time_t now = time(NULL);
+	mp::pthread_scoped_lock uplk(m_uploads_mutex);
+	expire_uploads(now);
+
+	uploads_t::iterator it = m_uploads.find(key);
+	if(it == m_uploads.end()) {
+		if(m_uploads.size() >= UPLOAD_LIMIT) { return false; }
+		it = m_uploads.insert(uploads_t::value_type(key, upload())).first;
+	}
+	it->second.parts[part] = chunks;
+	it->second.updated = now;
+	return true;
+}
+
+// the chunks of the dropped parts are left unreferred in the vector
+void ostorage::expire_uploads(time_t now)
+{
+	for(uploads_t::iterator it(m_uploads.begin()); it != m_uploads.end(); ) {
+		if(now - it->second.updated > UPLOAD_EXPIRE) {
+			std::cerr << "upload of " << it->first << " expired" << std::endl;
+			m_uploads.erase(it++);
+		} else {
+			++it;
+		}
+	}
+}
+
+bool ostorage::abort_upload(const std::string& key)
+{
+	mp::pthread_scoped_lock uplk(m_uploads_mutex);
+	return m_uploads.erase(key) > 0;
+}
+
+bool ostorage::complete_upload(const std::string& key, ClockTime ct)
+{
+	chunks_t chunks;
+	{
+		mp::pthread_scoped_lock uplk(m_uploads_mutex);
+		expire_uploads(time(NULL));
+		uploads_t::iterator it = m_uploads.find(key);
+		if(it == m_uploads.end()) { return false; }
+
+		parts_t& parts(it->second.parts);
+		size_t n = 0;
+		for(parts_t::iterator pt(parts.begin()), pt_end(parts.end());
+				pt != pt_end; ++pt, ++n) {
+			if(pt->first != n) { return false; }
+			chunks.insert(chunks.end(), pt->second.begin(), pt->second.end());
+		}
+		m_uploads.erase(it);
+	}
+
+	return update_chunks(key, chunks, ct);
+}
+
+
+size_t ostorage::update_batch(const std::vector<batch_entry>& entries, ClockTime ct)
+{
+	if(entries.empty()) { return 0; }
+
+	vecoff_t total = 0;
+	for(size_t i=0; i < entries.size(); ++i) {
+		if(entries[i].key.size() > 0xffff) {
+			throw std::runtime_error("key too long");
+		}
+		total += record_size(entries[i].key.size(), entries[i].size);
+	}
+
+	std::vector<block*> blocks;
+	blocks.reserve(entries.size());
+	for(size_t i=0; i < entries.size(); ++i) {
+		bool inl = entries[i].size <= m_inline_size;
+		block* bk = (block*)::malloc(sizeof(block) + (inl ? entries[i].size : 0));
+		if(!bk) {
+			for(size_t j=0; j < blocks.size(); ++j) { ::free(blocks[j]); }
+			throw std::bad_alloc();
+		}
+		blocks.push_back(bk);
+	}
+
+	// one extent for the whole batch
+	volume* v = select_volume(total);
+	vecoff_t rec = __sync_fetch_and_add(v->used, total);
+	vecoff_t begin = rec;
+
+	std::vector<record_header> headers(entries.size());
+	for(size_t i=0; i < entries.size(); ++i) {
+		const batch_entry& e(entries[i]);
+		block* bk = blocks[i];
+		uint32_t head = sizeof(record_header) + e.key.size();
+		init_block(bk, v, rec + head, head, e.size, e.size <= m_inline_size);
+		if(bk->m_data) {
+			memcpy(bk->m_data, e.body, e.size);
+		}
+		bk->set_crc(crc32c(0, e.body, e.size));
+		fill_record(v, &headers[i], e.key, e.size, ct,
+				RECORD_COMMITTED | RECORD_BCRC, bk->crc());
+		rec += record_size(e.key.size(), e.size);
+	}
+
+	try {
+		if(v->size < rec) {
+			expand_storage(v, rec);
+		}
+
+		// the records one after another, padded to 8 bytes
+		static const char pad[8] = {0};
+		std::vector<struct iovec> vec;
+		vec.reserve(OSTORAGE_WRITEV_LIMIT);
+		vecoff_t off = begin;
+		size_t len = 0;
+		for(size_t i=0; i <= entries.size(); ++i) {
+			if(i == entries.size() || vec.size() + 4 > OSTORAGE_WRITEV_LIMIT) {
+				ssize_t wl = ::pwritev(v->fd, &vec[0], vec.size(), off);
+				if(wl != (ssize_t)len) {
+					throw mp::system_error(wl < 0 ? errno : EIO, "can't write records");
+				}
+				off += len;
+				len = 0;
+				vec.clear();
+				if(i == entries.size()) { break; }
+			}
+			const batch_entry& e(entries[i]);
+			struct iovec iov[4] = {
+				{ &headers[i], sizeof(record_header) },
+				{ const_cast<char*>(e.key.data()), e.key.size() },
+				{ const_cast<char*>(e.body), e.size },
+				{ const_cast<char*>(pad), 0 },
+			};
+			size_t rlen = sizeof(record_header) + e.key.size() + e.size;
+			iov[3].iov_len = record_size(e.key.size(), e.size) - rlen;
+			vec.insert(vec.end(), iov, iov + 4);
+			len += rlen + iov[3].iov_len;
+		}
+
+		if(m_durability != SYNC_NONE) {
+			sync_range(v, begin, rec - begin);
+		}
+	} catch (...) {
+		// some of the records may be on the disk
+		if(v->size >= rec) { abandon_batch(v, begin, entries); }
+		for(size_t i=0; i < blocks.size(); ++i) { ::free(blocks[i]); }
+		throw;
+	}
+
+	// the index entries in one transaction. the leases follow the
+	// commit so that an aborted batch leaves nothing behind.
+	size_t stored = 0;
+	bool committed = false;
+	try {
+		mp::pthread_scoped_lock lslk(m_leases_mutex);
+		if(!tchdbtranbegin(m_index_map)) {
+			throw std::runtime_error("can't begin index transaction");
+		}
+		std::vector<bool> put(entries.size());
+		std::vector<vecoff_t> swapped(entries.size());
+		std::vector<uint32_t> swapped_size(entries.size());
+		try {
+			for(size_t i=0; i < entries.size(); ++i) {
+				put[i] = put_index_locked(entries[i].key, blocks[i], ct,
+						&swapped[i], &swapped_size[i]);
+			}
+		} catch (...) {
+			tchdbtranabort(m_index_map);
+			throw;
+		}
+		if(!tchdbtrancommit(m_index_map)) {
+			throw std::runtime_error("can't commit index transaction");
+		}
+		committed = true;
+		for(size_t i=0; i < entries.size(); ++i) {
+			if(put[i]) {
+				apply_lease_locked(entries[i].key, blocks[i], ct,
+						swapped[i], swapped_size[i]);
+				++stored;
+			}
+		}
+		if(m_durability == SYNC_FULL) {
+			sync_index();
+		}
+	} catch (...) {
+		if(!committed) { abandon_batch(v, begin, entries); }
+		for(size_t i=0; i < blocks.size(); ++i) { bfree_real(blocks[i]); }
+		throw;
+	}
+
+	for(size_t i=0; i < blocks.size(); ++i) { bfree_real(blocks[i]); }
+	return stored;
+}
+
+void ostorage::abandon_batch(volume* vol, vecoff_t begin,
+		const std::vector<batch_entry>& entries)
+{
+	vecoff_t rec = begin;
+	try {
+		for(size_t i=0; i < entries.size(); ++i) {
+			const batch_entry& e(entries[i]);
+			write_record(vol, rec, e.key, e.size, ClockTime(), RECORD_PENDING);
+			rec += record_size(e.key.size(), e.size);
+		}
+	} catch (std::exception& e) {
+		std::cerr << "can't abandon a batch: " << e.what() << std::endl;
+	}
+}
+
+
+}  // namespace kastor
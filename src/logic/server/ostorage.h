@@ -20,51 +20,209 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 #include <mp/pthread.h>
 #include <mp/exception.h>
 #include <string>
+#include <vector>
 #include <map>
 #include <tchdb.h>
+#include <tcbdb.h>
 #include "clock.h"
+#include "object_cache.h"
+
+// index value without an inline body
+#define INDEX_VALUE_SIZE 20
+
+#ifndef INDEX_INLINE_SIZE
+#define INDEX_INLINE_SIZE 256
+#endif
+
+// largest inline_size
+#ifndef INDEX_INLINE_LIMIT
+#define INDEX_INLINE_LIMIT 4096
+#endif
+
+// part numbers of a multipart upload are below this
+#ifndef UPLOAD_PART_LIMIT
+#define UPLOAD_PART_LIMIT 10000
+#endif
 
 namespace kastor {
 
 
 class ostorage {
-public:
-	ostorage(const std::string& storage_dir);
-	~ostorage();
-
 public:
 	typedef uint64_t vecoff_t;
 	typedef volatile unsigned int refcount_t;
 
+	enum durability_t {
+		SYNC_NONE,  // leave writeback to the OS
+		SYNC_DATA,  // fdatasync bodies before committing the index
+		SYNC_FULL,  // fdatasync bodies and sync the index after each commit
+	};
+
+	struct option {
+		option();
+		vecoff_t expand_size;
+		durability_t durability;
+		// rebuild the index from the vector records at startup
+		// with this many threads. 0 disables it.
+		size_t recover_threads;
+		// bytes per second the scrubber reads to verify the
+		// object checksums. 0 disables it.
+		uint64_t scrub_rate;
+		// bodies up to this size are kept in the index
+		uint32_t inline_size;
+		// bytes of the object cache. 0 disables it.
+		uint64_t cache_size;
+		// largest body in the object cache
+		uint32_t cache_object_max;
+		// larger bodies are stored in chunks of this size
+		uint32_t chunk_size;
+		// directories of the vector files, one per disk.
+		// the storage directory if empty.
+		std::vector<std::string> vector_dirs;
+		// keep the keys in order too for list()
+		bool key_index;
+		// seconds between the saves of the recently read keys.
+		// 0 disables it.
+		uint32_t hot_keys_interval;
+		// reads the keys saved by the last run into the leases with
+		// this many threads before the constructor returns.
+		// 0 disables it.
+		size_t warmup_threads;
+		// bytes of the index read ahead from its head during the
+		// warmup. 0 leaves the pages to the lookups.
+		uint64_t warmup_index_bytes;
+	};
+
+	ostorage(const std::string& storage_dir, const option& opt = option());
+	~ostorage();
+
+	// offsets outside a block are addresses in the set of the vector
+	// files; the number of the file is in the upper bits
+	static const int VOLUME_SHIFT = 48;
+	static const vecoff_t VOLUME_OFFSET_MASK = (1ULL << VOLUME_SHIFT) - 1;
+	static vecoff_t offset_of(vecoff_t addr) { return addr & VOLUME_OFFSET_MASK; }
+
+	// throws if no vector file has the address
+	int fd_of(vecoff_t addr) const;
+
+private:
+	struct volume;
+
+public:
 	class block {
 	public:
 		uint32_t size()   const { return m_size; }
-		vecoff_t offset() const { return m_off;  }
-		int fd() { return m_self->fd(); }
+		vecoff_t offset() const { return m_off;  }  // in the vector file
+		int fd() { return m_vol->fd; }
+
+		// body held in memory for small objects; NULL if it is
+		// only in the vector
+		char* data() { return m_data; }
+
+		// the body is a list of chunks; see chunks_of()
+		bool is_chunked() const { return m_chunked; }
+
+		// crc32c of the body
+		uint32_t crc() const { return m_crc; }
+		bool has_crc() const { return m_has_crc; }
+		void set_crc(uint32_t crc) { m_crc = crc; m_has_crc = true; }
 
 	private:
 		uint32_t  m_size;
+		uint32_t  m_head;  // record header and key before the body
+		uint32_t  m_crc;
+		bool      m_has_crc;
+		char*     m_data;
+		bool      m_chunked;
+		bool      m_writing;  // counted in volume::writing
 		vecoff_t  m_off;
+		volume*   m_vol;
 		ostorage* m_self;
 		bool is_free_block;
 		refcount_t m_refcount;
 		friend class ostorage;
+
+		vecoff_t address() const { return m_vol->base | m_off; }
 	};
 
 	class scoped_block;
 
 public:
-	block* balloc(uint32_t size);
+	// allocates a record for the key; the body follows its header
+	block* balloc(const std::string& key, uint32_t size);
 
 	block* read(std::string key);
 
+	// reads the keys, a batch of them under each lock of the leases.
+	// (*result)[i] is NULL if keys[i] is not found.
+	void read(const std::vector<std::string>& keys, std::vector<block*>* result);
+
 	bool update(std::string key, block* bk, ClockTime ct);
 
+	// an object of update_batch()
+	struct batch_entry {
+		std::string key;
+		const char* body;
+		uint32_t size;
+	};
+
+	// writes the objects into one extent of a vector file and commits
+	// their index entries in one transaction. returns the number of
+	// the entries stored; ones older than the current objects are not.
+	size_t update_batch(const std::vector<batch_entry>& entries, ClockTime ct);
+
+	// an extent of a body stored in chunks
+	struct chunk {
+		vecoff_t off;
+		uint32_t size;
+		uint32_t crc;
+	};
+	typedef std::vector<chunk> chunks_t;
+
+	uint32_t chunk_size() const { return m_chunk_size; }
+
+	// allocates a chunk of a large body. the crc of the block must
+	// be set before commit_chunk().
+	block* balloc_chunk(const std::string& key, uint32_t size);
+	chunk commit_chunk(const std::string& key, block* bk);
+
+	// makes the chunks the body of the key
+	bool update_chunks(const std::string& key, const chunks_t& chunks, ClockTime ct);
+
+	// returns the size of the body of a chunked block
+	static uint64_t chunks_of(block* bk, chunks_t* result);
+
+	// multipart upload; the parts of a key are collected until
+	// complete_upload() stores them in the order of their numbers.
+	// uploads without parts for a while are dropped.
+	// false if the number is out of range or too many uploads are
+	// in progress.
+	bool add_part(const std::string& key, size_t part, const chunks_t& chunks);
+	// false if no parts were added or a number is missing
+	bool complete_upload(const std::string& key, ClockTime ct);
+	// false if no parts were added
+	bool abort_upload(const std::string& key);
+
+	// the body from the object cache, read into it on a miss.
+	// NULL if the block is not cacheable or the body doesn't match
+	// its checksum; *corrupt tells the latter.
+	// release it with object_cache::release().
+	object_cache::body* read_body(block* bk, bool* corrupt);
+
 	bool remove(std::string key, ClockTime ct);
 
+	bool has_key_index() const { return m_key_map != NULL; }
+
+	// appends the keys beginning with prefix and following after, in
+	// order, up to limit. returns true if more keys follow.
+	// throws if the key index is disabled.
+	bool list(const std::string& prefix, const std::string& after,
+			size_t limit, std::vector<std::string>* result);
+
 	static void bfree(block* bk)
 	{
 		if(bk) {
@@ -72,23 +230,159 @@ public:
 		}
 	}
 
-	int fd() const { return m_vec_fd; }
+	// reads the body and compares it with its checksum.
+	// true if the block has no checksum.
+	bool verify(block* bk);
+
+	// scans the vector records and replaces the index with the
+	// newest record of each key. returns the number of keys.
+	size_t rebuild_index(size_t threads);
 
 private:
-	void expand_storage(vecoff_t req);
+	// vector record = header + key + body, padded to 8 bytes
+	struct record_header {
+		uint32_t magic;
+		uint32_t hcrc;       // crc32c of the rest of the header and the key
+		uint64_t clocktime;
+		uint32_t size;       // body size
+		uint32_t bcrc;       // crc32c of the body if RECORD_BCRC
+		uint16_t keylen;
+		uint16_t flags;
+		uint32_t seq;        // order of the writes in the same clocktime
+	};
+
+	static const uint32_t RECORD_MAGIC = 0x3152534b;  // "KSR1"
+
+	// index offset of a chunk list
+	static const vecoff_t INDEX_CHUNKED = 1ULL << 63;
+
+	enum record_flags_t {
+		RECORD_PENDING,    // body is being written
+		RECORD_COMMITTED,
+		RECORD_REMOVED,    // tombstone without body
+		RECORD_STATE_MASK = 0xff,
+		RECORD_BCRC = 0x100,
+		RECORD_CHUNK = 0x200,     // part of a body; not indexed
+		RECORD_MANIFEST = 0x400,  // body is a chunk list
+	};
+
+	static vecoff_t record_size(size_t keylen, uint32_t size);
+	static bool record_valid(const record_header& h, const char* key);
+
+	void fill_record(volume* vol, record_header* h, const std::string& key,
+			uint32_t size, ClockTime ct, int flags, uint32_t bcrc);
+	void write_record(volume* vol, vecoff_t rec, const std::string& key,
+			uint32_t size, ClockTime ct, int flags, uint32_t bcrc = 0,
+			const char* body = NULL);
+
+	void scan_tail(volume* vol);
+
+	// the body is kept in memory if in_memory is true
+	block* balloc(const std::string& key, uint32_t size, bool in_memory);
+	void init_block(block* bk, volume* vol, vecoff_t off,
+			uint32_t head, uint32_t size, bool in_memory);
+
+	class scanner;
+	struct scan_worker;
+
+	class scrubber;
+	scrubber* m_scrubber;
+	void start_scrubber(uint64_t rate);
+	void stop_scrubber();
+
+	// the keys of the leases, most recently read first
+	const std::string m_hot_keys_path;
+	class hot_keys_saver;
+	hot_keys_saver* m_hot_keys_saver;
+	void start_hot_keys_saver(uint32_t interval);
+	void stop_hot_keys_saver();
+	void save_hot_keys();
+
+	struct warmup_worker;
+	size_t warmup(const std::string& index_path, size_t threads,
+			uint64_t index_bytes);
+	// starts reading the body into the cache or the page cache
+	uint64_t prefetch(block* bk);
+
+	bool verify_extent(vecoff_t addr, uint32_t size, uint32_t crc);
+
+	// true if the index refers to the body at addr
+	bool is_current(const std::string& key, vecoff_t addr);
+
+	block* read_lease(const std::string& key);
+	bool update_lease(const std::string& key, block* bk, ClockTime ct);
+	bool update_lease_locked(const std::string& key, block* bk, ClockTime ct);
+	bool remove_lease(const std::string& key, ClockTime ct);
+
+	// update_lease_locked() in two steps; the index entry first and
+	// then the lease. *swapped is the body the entry replaced, or 0.
+	bool put_index_locked(const std::string& key, block* bk, ClockTime ct,
+			vecoff_t* swapped, uint32_t* swapped_size);
+	void apply_lease_locked(const std::string& key, block* bk, ClockTime ct,
+			vecoff_t swapped, uint32_t swapped_size);
+
+	// marks the records of a failed batch pending so that rebuilding
+	// the index doesn't revive them
+	void abandon_batch(volume* vol, vecoff_t begin,
+			const std::vector<batch_entry>& entries);
+
+	void sync_block(block* bk);
+	void sync_range(volume* vol, vecoff_t off, vecoff_t len);
+	void sync_index();
+
+	// fills the key index with the keys of the index
+	void rebuild_key_index();
+
+	// a vector file
+	struct volume {
+		uint32_t id;
+		vecoff_t base;  // id in the upper bits
+		int fd;
+		void* header_map;
+		volatile vecoff_t* used;    // used offset
+		vecoff_t records_begin;     // offset of the first record
+		volatile vecoff_t* closed;  // cleared while the storage is open
+		volatile uint64_t* seq;     // last record seq written
+		vecoff_t size;
+		mp::pthread_mutex mutex;    // expands the file
+		volatile unsigned int writing;  // bodies being written
+		volatile uint64_t avail;        // free bytes of the disk
+		volatile vecoff_t avail_used;   // used offset when avail was read
+	};
+
+	volume* open_volume(const std::string& dir, uint32_t id);
+	// clean marks the file as closed with the used offset synced
+	void close_volumes(bool clean);
+
+	// NULL if the address is out of the vector files
+	volume* volume_of(vecoff_t addr) const;
+
+	volume* select_volume(vecoff_t rsize);
+	void update_avail(volume* vol);
+	void end_write(block* bk);
+
+	void expand_storage(volume* vol, vecoff_t req);
+
+	object_cache* m_cache;
 
 	void add_free_pool(vecoff_t off, uint32_t size);
 
 	void bfree_real(block* bk);
 
 private:
-	// used offset
-	volatile vecoff_t* m_used;
+	// vector files; bodies are spread over them
+	std::vector<volume*> m_volumes;
+
+	// seq of the last record. the records of the vector files
+	// are ordered by it, not by their offsets.
+	volatile uint32_t m_seq;
+	void raise_seq(uint32_t seq);
 
 	// block lease map
 	struct lease_entry {
 		block* bk;
 		ClockTime clocktime;
+		uint64_t used;  // m_lease_tick when it was read last
 		inline lease_entry(block*, ClockTime);
 	};
 
@@ -98,10 +392,9 @@ private:
 	// FIXME hash
 	typedef std::map<std::string, lease_entry> leases_t;
 	leases_t m_leases;
+	uint64_t m_lease_tick;
 
 
-	void* m_header_map;
-
 
 	// offset => map tree
 	/*
@@ -120,10 +413,26 @@ private:
 	// size -> offset tree
 	/*TCBDB* m_free_map;*/
 
-	// storage vector;
-	int m_vec_fd;
-	mp::pthread_mutex m_storage_mutex;
-	vecoff_t m_vec_size;
+	// ordered keys of the objects not removed; NULL if disabled.
+	// updated with the index under m_leases_mutex.
+	TCBDB* m_key_map;
+
+	const vecoff_t m_expand_size;
+	const durability_t m_durability;
+	const uint32_t m_inline_size;
+	const uint32_t m_chunk_size;
+
+	// multipart uploads: key => part number => chunks
+	typedef std::map<size_t, chunks_t> parts_t;
+	struct upload {
+		parts_t parts;
+		time_t updated;  // when the last part was added
+	};
+	typedef std::map<std::string, upload> uploads_t;
+	mp::pthread_mutex m_uploads_mutex;
+	uploads_t m_uploads;
+	// m_uploads_mutex must be locked
+	void expire_uploads(time_t now);
 
 private:
 	ostorage();
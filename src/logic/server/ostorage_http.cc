@@ -17,9 +17,38 @@
 //
 #include "server/ostorage_http.h"
 #include "server/framework.h"
+#include "server/crc32c.h"
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// largest body of a POST request
+#ifndef HTTP_POST_BODY_LIMIT
+#define HTTP_POST_BODY_LIMIT (1024*1024)
+#endif
+
+// largest body of a batch PUT
+#ifndef HTTP_MPUT_BODY_LIMIT
+#define HTTP_MPUT_BODY_LIMIT (16*1024*1024)
+#endif
+
+// keys of a batch GET
+#ifndef HTTP_MGET_LIMIT
+#define HTTP_MGET_LIMIT 1024
+#endif
+
+#define MGET_BOUNDARY "kastor-batch"
+
+// keys in a LIST response
+#ifndef HTTP_LIST_LIMIT
+#define HTTP_LIST_LIMIT 1000
+#endif
 
 namespace kastor {
 
@@ -36,14 +65,60 @@ static const char* CREATED =
 	"\r\n"
 	"Created\r\n";
 
+static const char* NO_CONTENT =
+	"HTTP/1.1 204 No Content\r\n"
+	"\r\n";
+
+static const char* BAD_REQUEST =
+	"HTTP/1.1 400 Bad Request\r\n"
+	"Content-Length: 11\r\n"
+	"\r\n"
+	"Bad Request\r\n";
+
+static const char* ENTITY_TOO_LARGE =
+	"HTTP/1.1 413 Request Entity Too Large\r\n"
+	"Connection: close\r\n"
+	"Content-Length: 24\r\n"
+	"\r\n"
+	"Request Entity Too Large\r\n";
+
+static const char* INTERNAL_ERROR =
+	"HTTP/1.1 500 Internal Server Error\r\n"
+	"Content-Length: 21\r\n"
+	"\r\n"
+	"Internal Server Error\r\n";
+
+static const char* NOT_IMPLEMENTED =
+	"HTTP/1.1 501 Not Implemented\r\n"
+	"Content-Length: 15\r\n"
+	"\r\n"
+	"Not Implemented\r\n";
+
 static const char* OK_FORMAT =
 	"HTTP/1.1 200 OK\r\n"
 	"Content-Length: %llu\r\n"
 	"\r\n";
 
+// a batch of which some objects were not stored
+static const char* MPUT_CONFLICT_FORMAT =
+	"HTTP/1.1 409 Conflict\r\n"
+	"X-Stored: %llu\r\n"
+	"Content-Length: 8\r\n"
+	"\r\n"
+	"Conflict\r\n";
+
 ostorage_http::ostorage_http(int fd) :
 	http_handler<ostorage_http>(fd),
-	m_map(NULL), m_map_off(0) { }
+	m_map(NULL), m_map_off(0), m_body(NULL),
+	m_filled(0), m_crc(0), m_chunked(false), m_part(-1),
+	m_post(POST_NONE) { }
+
+bool ostorage_http::s_verify_get = false;
+
+void ostorage_http::set_verify_get(bool verify)
+{
+	s_verify_get = verify;
+}
 
 ostorage_http::~ostorage_http()
 {
@@ -56,10 +131,29 @@ static void buf_free(void* buf)
 	::free(buf);
 }
 
+static void body_buf_free(void* buf)
+{
+	object_cache::release(*(object_cache::body**)buf);
+	::free(buf);
+}
+
+namespace {
+	// GET of these lists the keys, so they can't be keys
+	bool is_list_path(const std::string& path)
+	{
+		return path == "/?list" || path.compare(0, 7, "/?list&") == 0;
+	}
+}
+
 void ostorage_http::process_get(const char* path, size_t pathlen, headers_t& h)
 {
 	std::cout << "http get " << path << " " << pathlen << std::endl;
 	std::string key(path, pathlen);
+
+	if(is_list_path(key)) {
+		process_list(key.substr(6));
+		return;
+	}
 	scoped_block bk( net->storage().read(key) );
 
 	if(!bk) {
@@ -67,15 +161,81 @@ void ostorage_http::process_get(const char* path, size_t pathlen, headers_t& h)
 		return;
 	}
 
+	object_cache::body* cached = NULL;
+	bool corrupt = false;
+	if(!bk->data()) {
+		cached = net->storage().read_body(bk.get(), &corrupt);
+	}
+
+	// cached bodies are checked when they are read
+	if(corrupt || (!cached && s_verify_get && !net->storage().verify(bk.get()))) {
+		std::cerr << "checksum mismatch of " << key << std::endl;
+		wavy::send(fd(), INTERNAL_ERROR, strlen(INTERNAL_ERROR), NULL, NULL);
+		return;
+	}
+
 	char* buf = (char*)::malloc(
-			sizeof(ostorage::block**) + strlen(OK_FORMAT)+10);
+			sizeof(ostorage::block**) + strlen(OK_FORMAT)+20);
 
-	if(!buf) { throw std::bad_alloc(); }
+	if(!buf) {
+		if(cached) { object_cache::release(cached); }
+		throw std::bad_alloc();
+	}
 
 	*(ostorage::block**)buf = bk.get();
 	char* header = buf + sizeof(ostorage::block**);
 
-	int header_len = sprintf(header, OK_FORMAT, bk->size());
+	if(bk->is_chunked()) {
+		// the chunks are sent from the vector files one after another
+		wavy::xfer xf;
+		try {
+			ostorage::chunks_t chunks;
+			uint64_t total = ostorage::chunks_of(bk.get(), &chunks);
+
+			struct iovec vec;
+			vec.iov_base = header;
+			vec.iov_len = sprintf(header, OK_FORMAT, (unsigned long long)total);
+
+			xf.push_iov(&vec, 1);
+			for(ostorage::chunks_t::iterator it(chunks.begin()), it_end(chunks.end());
+					it != it_end; ++it) {
+				xf.push_file(net->storage().fd_of(it->off),
+						ostorage::offset_of(it->off), it->size);
+			}
+		} catch (...) {
+			::free(buf);
+			throw;
+		}
+		xf.push_finalize(&buf_free, buf);
+		bk.release();
+		wavy::send(fd(), &xf);
+		return;
+	}
+
+	int header_len = sprintf(header, OK_FORMAT, (unsigned long long)bk->size());
+
+	if(cached) {
+		*(object_cache::body**)buf = cached;
+		struct iovec vec[2];
+		vec[0].iov_base = header;
+		vec[0].iov_len = header_len;
+		vec[1].iov_base = cached->data();
+		vec[1].iov_len = cached->size();
+		wavy::send(fd(), vec, 2, &body_buf_free, buf);
+		return;
+	}
+
+	if(bk->data()) {
+		// small object kept in memory
+		struct iovec vec[2];
+		vec[0].iov_base = header;
+		vec[0].iov_len = header_len;
+		vec[1].iov_base = bk->data();
+		vec[1].iov_len = bk->size();
+		wavy::send(fd(), vec, 2, &buf_free, buf);
+		bk.release();
+		return;
+	}
 
 	wavy::send(fd(),
 			header, header_len,
@@ -84,25 +244,137 @@ void ostorage_http::process_get(const char* path, size_t pathlen, headers_t& h)
 	bk.release();
 }
 
-void ostorage_http::reset_map()
+namespace {
+	// %XX escapes; false if malformed
+	bool url_decode(const std::string& in, std::string* out)
+	{
+		out->clear();
+		for(size_t i=0; i < in.size(); ++i) {
+			if(in[i] != '%') {
+				out->push_back(in[i]);
+				continue;
+			}
+			if(i + 2 >= in.size() || !isxdigit((unsigned char)in[i+1]) ||
+					!isxdigit((unsigned char)in[i+2])) {
+				return false;
+			}
+			out->push_back((char)strtol(in.substr(i+1, 2).c_str(), NULL, 16));
+			i += 2;
+		}
+		return true;
+	}
+}
+
+// GET /?list&prefix=<prefix>&after=<key>&limit=<n>
+// the keys in order, one per line. if "X-Truncated: true" is set,
+// the next page follows the last key.
+void ostorage_http::process_list(const std::string& query)
+{
+	if(!net->storage().has_key_index()) {
+		wavy::send(fd(), NOT_IMPLEMENTED, strlen(NOT_IMPLEMENTED), NULL, NULL);
+		return;
+	}
+
+	std::string prefix;
+	std::string after;
+	size_t limit = HTTP_LIST_LIMIT;
+
+	std::string::size_type pos = 0;
+	while(pos < query.size()) {
+		// query[pos] is '&'
+		std::string::size_type end = query.find('&', pos+1);
+		if(end == std::string::npos) { end = query.size(); }
+		std::string param(query, pos+1, end - pos - 1);
+		pos = end;
+
+		std::string::size_type eq = param.find('=');
+		std::string name(param, 0, eq);
+		std::string value;
+		if(eq == std::string::npos ||
+				!url_decode(param.substr(eq+1), &value)) {
+			wavy::send(fd(), BAD_REQUEST, strlen(BAD_REQUEST), NULL, NULL);
+			return;
+		}
+
+		if(name == "prefix") {
+			prefix = value;
+		} else if(name == "after") {
+			after = value;
+		} else if(name == "limit" && !value.empty() &&
+				value.find_first_not_of("0123456789") == std::string::npos) {
+			limit = std::min((size_t)::atol(value.c_str()), (size_t)HTTP_LIST_LIMIT);
+		} else {
+			wavy::send(fd(), BAD_REQUEST, strlen(BAD_REQUEST), NULL, NULL);
+			return;
+		}
+	}
+
+	std::vector<std::string> keys;
+	bool more = net->storage().list(prefix, after, limit, &keys);
+
+	std::cout << "http list " << keys.size() << " keys" << std::endl;
+
+	std::string body;
+	for(std::vector<std::string>::iterator it(keys.begin()), it_end(keys.end());
+			it != it_end; ++it) {
+		body += *it;
+		body += '\n';
+	}
+
+	char header[128];
+	int header_len = snprintf(header, sizeof(header),
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/plain\r\n"
+			"%s"
+			"Content-Length: %llu\r\n"
+			"\r\n",
+			more ? "X-Truncated: true\r\n" : "",
+			(unsigned long long)body.size());
+
+	char* buf = (char*)::malloc(header_len + body.size());
+	if(!buf) { throw std::bad_alloc(); }
+	memcpy(buf, header, header_len);
+	memcpy(buf + header_len, body.data(), body.size());
+
+	wavy::send(fd(), buf, header_len + body.size(), &::free, buf);
+}
+
+void ostorage_http::unmap()
 {
 	if(m_map) {
 		size_t map_size = (m_block->size() + m_map_off + sysconf(_SC_PAGE_SIZE)-1)
 			& ~(sysconf(_SC_PAGE_SIZE)-1);
 		::munmap(m_map, map_size);
 		m_map = NULL;
-		m_block.reset();
-		m_key = "";
 	}
+	m_body = NULL;
+	m_block.reset();
 }
 
-void ostorage_http::reset_map(const char* path, size_t pathlen, size_t content_length)
+void ostorage_http::reset_map()
 {
-	reset_map();
+	unmap();
+	m_chunks.clear();
+	m_key = "";
+}
 
-	m_key = std::string(path, pathlen);
+void ostorage_http::map_block(uint32_t size)
+{
+	unmap();
+
+	m_filled = 0;
+	m_crc = 0;
 
-	m_block.reset( net->storage().balloc(content_length) );
+	if(m_chunked) {
+		m_block.reset( net->storage().balloc_chunk(m_key, size) );
+	} else {
+		m_block.reset( net->storage().balloc(m_key, size) );
+	}
+
+	if(m_block->data()) {
+		m_body = m_block->data();
+		return;
+	}
 
 	m_map_off = m_block->offset()
 		- (m_block->offset() / sysconf(_SC_PAGE_SIZE) * sysconf(_SC_PAGE_SIZE));
@@ -119,21 +391,118 @@ void ostorage_http::reset_map(const char* path, size_t pathlen, size_t content_l
 	}
 
 	m_map = (char*)map;
+	m_body = m_map + m_map_off;
 }
 
+// PUT /key                  stores the body, in chunks if it is large
+// PUT /key?part=<n>         stores part n of a multipart upload
+// PUT /key?complete         joins the parts 0..n in order
+// PUT /key?abort            drops the parts
 void ostorage_http::process_put(const char* path, size_t pathlen, headers_t& h,
 		size_t content_length)
 {
 	std::cout << "http put " << path << " " << pathlen << std::endl;
 	std::cout << "clen: " << content_length << std::endl;
-	reset_map(path, pathlen, content_length);
+
+	reset_map();
+
+	// other queries are a part of the key as GET reads it
+	std::string path_str(path, pathlen);
+	std::string::size_type query = path_str.rfind('?');
+	std::string q;
+	if(query != std::string::npos) {
+		q = path_str.substr(query+1);
+		if(q != "complete" && q != "abort" && q.compare(0, 5, "part=") != 0) {
+			q.clear();
+			query = std::string::npos;
+		}
+	}
+	m_key = path_str.substr(0, query);
+	m_part = -1;
+
+	if(is_list_path(m_key)) {
+		// the body is not read; the connection can't be reused
+		wavy::send(fd(), BAD_REQUEST, strlen(BAD_REQUEST), NULL, NULL);
+		throw std::runtime_error("reserved key");
+	}
+
+	if(q == "complete" || q == "abort") {
+		if(content_length != 0) {
+			throw std::runtime_error("invalid request");
+		}
+		if(q == "abort") {
+			if(net->storage().abort_upload(m_key)) {
+				wavy::send(fd(), NO_CONTENT, strlen(NO_CONTENT), NULL, NULL);
+			} else {
+				wavy::send(fd(), NOT_FOUND, strlen(NOT_FOUND), NULL, NULL);
+			}
+			reset_map();
+			return;
+		}
+		ClockTime clocktime( Clock(0), time(NULL) );
+		if(net->storage().complete_upload(m_key, clocktime)) {
+			wavy::send(fd(), CREATED, strlen(CREATED), NULL, NULL);
+		} else {
+			wavy::send(fd(), BAD_REQUEST, strlen(BAD_REQUEST), NULL, NULL);
+		}
+		reset_map();
+		return;
+	} else if(!q.empty()) {
+		if(q.size() == 5 || q.size() > 5 + 9 ||
+				q.find_first_not_of("0123456789", 5) != std::string::npos) {
+			throw std::runtime_error("invalid request");
+		}
+		m_part = ::atol(q.c_str() + 5);
+		if(m_part >= UPLOAD_PART_LIMIT) {
+			throw std::runtime_error("invalid part number");
+		}
+	}
+
+	m_chunked = m_part >= 0 || content_length > net->storage().chunk_size();
+
+	if(content_length == 0) {
+		if(!m_chunked) { map_block(0); }
+		commit();
+		return;
+	}
+
+	if(m_chunked) {
+		map_block(std::min(content_length, (size_t)net->storage().chunk_size()));
+	} else {
+		map_block(content_length);
+	}
+}
+
+void ostorage_http::commit()
+{
+	ClockTime clocktime( Clock(0), time(NULL) );
+	if(!m_chunked) {
+		m_block->set_crc(m_crc);
+		net->storage().update(m_key, m_block.get(), clocktime);
+	} else if(m_part >= 0) {
+		if(!net->storage().add_part(m_key, m_part, m_chunks)) {
+			// too many uploads in progress
+			wavy::send(fd(), BAD_REQUEST, strlen(BAD_REQUEST), NULL, NULL);
+			reset_map();
+			return;
+		}
+	} else {
+		net->storage().update_chunks(m_key, m_chunks, clocktime);
+	}
+	wavy::send(fd(), CREATED, strlen(CREATED), NULL, NULL);
+	reset_map();
 }
 
 void ostorage_http::process_data(handler_stream s, size_t* content_length)
 {
-	size_t off = m_block->size() - (*content_length);
+	if(m_post != POST_NONE) {
+		process_post_data(s, content_length);
+		return;
+	}
 
-	ssize_t rl = s.read(m_map + m_map_off + off, *content_length);
+	size_t want = std::min(m_block->size() - m_filled, *content_length);
+
+	ssize_t rl = s.read(m_body + m_filled, want);
 	if(rl <= 0) {
 		if(rl == 0) {
 			throw mp::system_error(errno, "connection closed");
@@ -147,16 +516,337 @@ void ostorage_http::process_data(handler_stream s, size_t* content_length)
 
 	std::cout << "read content " << rl << std::endl;
 
+	// while the bytes are still in the cache
+	m_crc = crc32c(m_crc, m_body + m_filled, rl);
+
+	m_filled += rl;
+	*content_length -= rl;
+
+	if(m_filled < m_block->size()) { return; }
+
+	if(m_chunked) {
+		m_block->set_crc(m_crc);
+		m_chunks.push_back(net->storage().commit_chunk(m_key, m_block.get()));
+		if(*content_length > 0) {
+			map_block(std::min(*content_length, (size_t)net->storage().chunk_size()));
+			return;
+		}
+	}
+
+	commit();
+}
+
+
+// POST /?mget   body: keys, one per line
+// POST /?mput   body: "<key> <size>\n<body>" for each object
+// other paths get 404, and bodies over the limit 413 before closing
+void ostorage_http::process_post(const char* path, size_t pathlen, headers_t& h,
+		size_t content_length)
+{
+	std::cout << "http post " << path << " " << pathlen << std::endl;
+
+	reset_map();
+
+	std::string q(path, pathlen);
+	size_t limit;
+	if(q == "/?mget") {
+		m_post = POST_MGET;
+		limit = HTTP_POST_BODY_LIMIT;
+	} else if(q == "/?mput") {
+		m_post = POST_MPUT;
+		limit = HTTP_MPUT_BODY_LIMIT;
+	} else {
+		m_post = POST_UNKNOWN;
+		limit = HTTP_POST_BODY_LIMIT;
+	}
+
+	if(content_length > limit) {
+		// the body is not read; the connection can't be reused
+		m_post = POST_NONE;
+		wavy::send(fd(), ENTITY_TOO_LARGE, strlen(ENTITY_TOO_LARGE), NULL, NULL);
+		throw std::runtime_error("request body too large");
+	}
+	m_post_body.resize(content_length);
+	m_filled = 0;
+
+	if(content_length == 0) {
+		finish_post();
+	}
+}
+
+void ostorage_http::process_post_data(handler_stream s, size_t* content_length)
+{
+	ssize_t rl = s.read(&m_post_body[m_filled], *content_length);
+	if(rl <= 0) {
+		if(rl == 0) {
+			throw mp::system_error(errno, "connection closed");
+		}
+		if(errno == EAGAIN || errno == EINTR) {
+			return;
+		} else {
+			throw mp::system_error(errno, "read error");
+		}
+	}
+
+	m_filled += rl;
 	*content_length -= rl;
 
 	if(*content_length == 0) {
-		ClockTime clocktime( Clock(0), time(NULL) );
-		net->storage().update(m_key, m_block.get(), clocktime);
+		finish_post();
+	}
+}
+
+void ostorage_http::finish_post()
+{
+	post_t post = m_post;
+	m_post = POST_NONE;
+	if(post == POST_MGET) {
+		process_mget();
+	} else if(post == POST_MPUT) {
+		process_mput();
+	} else {
+		wavy::send(fd(), NOT_FOUND, strlen(NOT_FOUND), NULL, NULL);
+	}
+	std::string().swap(m_post_body);
+}
+
+
+namespace {
+	// referred by a batch response until it is sent
+	struct mget_refs {
+		mget_refs() { }
+		~mget_refs();
+
+		std::vector<ostorage::block*> blocks;
+		std::vector<object_cache::body*> bodies;
+		std::string head;   // response header
+		std::string parts;  // part headers and delimiters
+
+	private:
+		mget_refs(const mget_refs&);
+	};
+
+	mget_refs::~mget_refs()
+	{
+		for(size_t i=0; i < blocks.size(); ++i) {
+			ostorage::bfree(blocks[i]);
+		}
+		for(size_t i=0; i < bodies.size(); ++i) {
+			object_cache::release(bodies[i]);
+		}
+	}
+
+	static void mget_refs_free(void* refs)
+	{
+		delete (mget_refs*)refs;
+	}
+
+	// a piece of the response. part headers are offsets of
+	// mget_refs::parts as it grows.
+	struct mget_segment {
+		const char* mem;
+		size_t off;
+		size_t len;
+		int fd;  // -1 unless from a file
+	};
+
+	static void push_part_header(mget_refs* refs, std::vector<mget_segment>* segs,
+			const char* fmt, const std::string& key, unsigned long long len)
+	{
+		char buf[128];
+		int n = snprintf(buf, sizeof(buf), fmt, len);
+
+		mget_segment sg = { NULL, refs->parts.size(), 0, -1 };
+		if(!refs->parts.empty()) {
+			refs->parts += "\r\n";
+		}
+		refs->parts += "--" MGET_BOUNDARY "\r\nContent-Location: ";
+		refs->parts += key;
+		refs->parts += "\r\n";
+		refs->parts.append(buf, n);
+		sg.len = refs->parts.size() - sg.off;
+		segs->push_back(sg);
+	}
+}  // noname namespace
+
+// multipart/mixed with a part for each key in the order of the keys.
+// a part has Content-Location and Content-Length, and Status if the
+// object can't be sent.
+void ostorage_http::process_mget()
+{
+	std::vector<std::string> keys;
+	std::string::size_type pos = 0;
+	while(pos < m_post_body.size()) {
+		std::string::size_type end = m_post_body.find('\n', pos);
+		if(end == std::string::npos) { end = m_post_body.size(); }
+		std::string::size_type kend = end;
+		if(kend > pos && m_post_body[kend-1] == '\r') { --kend; }
+		if(kend > pos) {
+			keys.push_back(m_post_body.substr(pos, kend - pos));
+		}
+		pos = end + 1;
+	}
+
+	std::cout << "http mget " << keys.size() << " keys" << std::endl;
+
+	if(keys.size() > HTTP_MGET_LIMIT) {
+		wavy::send(fd(), BAD_REQUEST, strlen(BAD_REQUEST), NULL, NULL);
+		return;
+	}
+
+	std::auto_ptr<mget_refs> refs(new mget_refs());
+	net->storage().read(keys, &refs->blocks);
+
+	std::vector<mget_segment> segs;
+	uint64_t bodies = 0;
+	for(size_t i=0; i < keys.size(); ++i) {
+		ostorage::block* bk = refs->blocks[i];
+		if(!bk) {
+			push_part_header(refs.get(), &segs,
+					"Status: 404 Not Found\r\nContent-Length: %llu\r\n\r\n",
+					keys[i], 0);
+			continue;
+		}
+
+		object_cache::body* cached = NULL;
+		bool corrupt = false;
+		if(!bk->data() && !bk->is_chunked()) {
+			cached = net->storage().read_body(bk, &corrupt);
+			if(cached) { refs->bodies.push_back(cached); }
+		}
+
+		if(corrupt || (!cached && s_verify_get && !net->storage().verify(bk))) {
+			std::cerr << "checksum mismatch of " << keys[i] << std::endl;
+			push_part_header(refs.get(), &segs,
+					"Status: 500 Internal Server Error\r\nContent-Length: %llu\r\n\r\n",
+					keys[i], 0);
+			continue;
+		}
+
+		if(bk->is_chunked()) {
+			ostorage::chunks_t chunks;
+			uint64_t total = ostorage::chunks_of(bk, &chunks);
+			push_part_header(refs.get(), &segs,
+					"Content-Length: %llu\r\n\r\n", keys[i], total);
+			for(ostorage::chunks_t::iterator it(chunks.begin()), it_end(chunks.end());
+					it != it_end; ++it) {
+				mget_segment sg = { NULL, ostorage::offset_of(it->off), it->size,
+					net->storage().fd_of(it->off) };
+				segs.push_back(sg);
+			}
+			bodies += total;
+			continue;
+		}
+
+		push_part_header(refs.get(), &segs,
+				"Content-Length: %llu\r\n\r\n", keys[i], bk->size());
+		if(cached) {
+			mget_segment sg = { cached->data(), 0, cached->size(), -1 };
+			segs.push_back(sg);
+		} else if(bk->data()) {
+			mget_segment sg = { bk->data(), 0, bk->size(), -1 };
+			segs.push_back(sg);
+		} else {
+			mget_segment sg = { NULL, bk->offset(), bk->size(), bk->fd() };
+			segs.push_back(sg);
+		}
+		bodies += bk->size();
+	}
+
+	mget_segment close = { NULL, refs->parts.size(), 0, -1 };
+	refs->parts += keys.empty() ?
+		"--" MGET_BOUNDARY "--\r\n" : "\r\n--" MGET_BOUNDARY "--\r\n";
+	close.len = refs->parts.size() - close.off;
+	segs.push_back(close);
+
+	char head[128];
+	int head_len = snprintf(head, sizeof(head),
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: multipart/mixed; boundary=" MGET_BOUNDARY "\r\n"
+			"Content-Length: %llu\r\n"
+			"\r\n",
+			(unsigned long long)(refs->parts.size() + bodies));
+	refs->head.assign(head, head_len);
+
+	// consecutive memory segments go in one writev
+	wavy::xfer xf;
+	std::vector<struct iovec> vec;
+	struct iovec v = { (void*)refs->head.data(), refs->head.size() };
+	vec.push_back(v);
+	for(size_t i=0; i < segs.size(); ++i) {
+		const mget_segment& sg(segs[i]);
+		if(sg.fd >= 0) {
+			if(!vec.empty()) {
+				xf.push_iov(&vec[0], vec.size());
+				vec.clear();
+			}
+			xf.push_file(sg.fd, sg.off, sg.len);
+			continue;
+		}
+		v.iov_base = (void*)(sg.mem ? sg.mem : refs->parts.data() + sg.off);
+		v.iov_len = sg.len;
+		if(v.iov_len > 0) { vec.push_back(v); }
+	}
+	if(!vec.empty()) {
+		xf.push_iov(&vec[0], vec.size());
+	}
+	xf.push_finalize(&mget_refs_free, refs.release());
+
+	wavy::send(fd(), &xf);
+}
+
+// the bodies are written straight from the request buffer.
+// 201 if all of them are stored, otherwise 409 with X-Stored.
+void ostorage_http::process_mput()
+{
+	std::vector<ostorage::batch_entry> entries;
+	const char* p = m_post_body.data();
+	const char* const pend = p + m_post_body.size();
+	while(p < pend) {
+		const char* nl = (const char*)memchr(p, '\n', pend - p);
+		const char* sp = nl ? (const char*)memchr(p, ' ', nl - p) : NULL;
+		if(!sp || sp == p) {
+			wavy::send(fd(), BAD_REQUEST, strlen(BAD_REQUEST), NULL, NULL);
+			return;
+		}
+
+		char* end;
+		unsigned long long size = strtoull(sp + 1, &end, 10);
+		if(end == sp + 1 || (end != nl && !(*end == '\r' && end + 1 == nl)) ||
+				size > (unsigned long long)(pend - (nl + 1))) {
+			wavy::send(fd(), BAD_REQUEST, strlen(BAD_REQUEST), NULL, NULL);
+			return;
+		}
+
+		ostorage::batch_entry e;
+		e.key.assign(p, sp - p);
+		if(is_list_path(e.key)) {
+			wavy::send(fd(), BAD_REQUEST, strlen(BAD_REQUEST), NULL, NULL);
+			return;
+		}
+		e.body = nl + 1;
+		e.size = size;
+		entries.push_back(e);
+
+		p = nl + 1 + size;
+	}
+
+	std::cout << "http mput " << entries.size() << " objects" << std::endl;
+
+	ClockTime clocktime( Clock(0), time(NULL) );
+	size_t stored = net->storage().update_batch(entries, clocktime);
+
+	if(stored == entries.size()) {
 		wavy::send(fd(), CREATED, strlen(CREATED), NULL, NULL);
-		reset_map();
+		return;
 	}
+
+	// older than the current objects or failed to be indexed
+	char* buf = (char*)::malloc(strlen(MPUT_CONFLICT_FORMAT)+20);
+	if(!buf) { throw std::bad_alloc(); }
+	int len = sprintf(buf, MPUT_CONFLICT_FORMAT, (unsigned long long)stored);
+	wavy::send(fd(), buf, len, &::free, buf);
 }
 
 
 }  // namespace kastor
-
@@ -35,8 +35,13 @@ public:
 	void process_put(const char* path, size_t pathlen, headers_t& h,
 			size_t content_length);
 
+	void process_post(const char* path, size_t pathlen, headers_t& h,
+			size_t content_length);
+
 	void process_data(handler_stream s, size_t* content_length);
 
+	static void set_verify_get(bool verify);
+
 private:
 	typedef ostorage::scoped_block scoped_block;
 
@@ -46,8 +51,50 @@ private:
 	char* m_map;
 	size_t m_map_off;
 
+	// m_map + m_map_off, or the inline body of the block
+	char* m_body;
+
+	// bytes of m_block read so far, and their crc32c
+	size_t m_filled;
+	uint32_t m_crc;
+
+	// the body is stored in chunks of ostorage::chunk_size();
+	// m_part is the part number of a multipart upload or -1
+	bool m_chunked;
+	ssize_t m_part;
+	ostorage::chunks_t m_chunks;
+
+	// POST request whose body is read into m_post_body
+	enum post_t {
+		POST_NONE,
+		POST_MGET,
+		POST_MPUT,
+		POST_UNKNOWN,  // read to keep the connection, then 404
+	};
+	post_t m_post;
+	std::string m_post_body;
+
+	static bool s_verify_get;
+
 	void reset_map();
-	void reset_map(const char* path, size_t pathlen, size_t content_length);
+	void unmap();
+
+	// allocates and maps the next block of m_key
+	void map_block(uint32_t size);
+
+	void commit();
+
+	void process_post_data(handler_stream s, size_t* content_length);
+	void finish_post();
+
+	// sends the keys from the key index
+	void process_list(const std::string& query);
+
+	// sends the objects of the keys listed in m_post_body
+	void process_mget();
+
+	// stores the objects framed in m_post_body
+	void process_mput();
 
 private:
 	ostorage_http();
@@ -0,0 +1,731 @@
+//
+// Kastor
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "ostorage.h"
+#include "crc32c.h"
+#include <mp/pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+// sequential reads while scanning the records
+#ifndef RECOVER_READ_SIZE
+#define RECOVER_READ_SIZE (4*1024*1024)
+#endif
+
+// reads after skipping a large body
+#ifndef RECOVER_SEEK_READ_SIZE
+#define RECOVER_SEEK_READ_SIZE (64*1024)
+#endif
+
+// smallest range scanned by a recovery thread
+#ifndef RECOVER_MIN_RANGE
+#define RECOVER_MIN_RANGE (64LLU*1024*1024)
+#endif
+
+// reads while verifying a body
+#ifndef VERIFY_READ_SIZE
+#define VERIFY_READ_SIZE (256*1024)
+#endif
+
+// seconds between the scrubber passes
+#ifndef SCRUB_INTERVAL
+#define SCRUB_INTERVAL 600
+#endif
+
+namespace kastor {
+
+
+class ostorage::scanner {
+public:
+	scanner(int fd, vecoff_t end);
+	~scanner();
+
+	// returns len bytes at off, or NULL past the end
+	const char* load(vecoff_t off, size_t len);
+
+	// returns the header and the key of a valid record at off
+	const char* load_record(vecoff_t off);
+
+private:
+	int m_fd;
+	vecoff_t m_end;
+	char* m_buf;
+	size_t m_capacity;
+	vecoff_t m_off;
+	size_t m_len;
+
+private:
+	scanner();
+	scanner(const scanner&);
+};
+
+ostorage::scanner::scanner(int fd, vecoff_t end) :
+	m_fd(fd), m_end(end), m_buf(NULL),
+	m_capacity(RECOVER_READ_SIZE), m_off(0), m_len(0)
+{
+	m_buf = (char*)::malloc(m_capacity);
+	if(!m_buf) { throw std::bad_alloc(); }
+}
+
+ostorage::scanner::~scanner()
+{
+	::free(m_buf);
+}
+
+const char* ostorage::scanner::load(vecoff_t off, size_t len)
+{
+	if(off + len > m_end) { return NULL; }
+
+	if(m_off <= off && off + len <= m_off + m_len) {
+		return m_buf + (off - m_off);
+	}
+
+	if(m_capacity < len) {
+		char* tmp = (char*)::realloc(m_buf, len);
+		if(!tmp) { throw std::bad_alloc(); }
+		m_buf = tmp;
+		m_capacity = len;
+	}
+
+	// read ahead when the records continue where the last read ended
+	size_t want = (off <= m_off + m_len) ? m_capacity : RECOVER_SEEK_READ_SIZE;
+	want = std::max(want, len);
+	want = std::min(want, m_capacity);
+	want = std::min((vecoff_t)want, m_end - off);
+
+	size_t got = 0;
+	while(got < want) {
+		ssize_t rl = ::pread(m_fd, m_buf + got, want - got, off + got);
+		if(rl < 0) {
+			if(errno == EINTR) { continue; }
+			throw mp::system_error(errno, "can't read vector");
+		} else if(rl == 0) {
+			break;
+		}
+		got += rl;
+	}
+
+	// scans shouldn't push the objects being served out of the page cache
+	if(got > 0) {
+		::posix_fadvise(m_fd, off, got, POSIX_FADV_DONTNEED);
+	}
+
+	m_off = off;
+	m_len = got;
+	if(got < len) { return NULL; }
+	return m_buf;
+}
+
+const char* ostorage::scanner::load_record(vecoff_t off)
+{
+	const char* p = load(off, sizeof(record_header));
+	if(!p) { return NULL; }
+
+	record_header h;
+	memcpy(&h, p, sizeof(h));
+	if(h.magic != RECORD_MAGIC) { return NULL; }
+
+	p = load(off, sizeof(h) + h.keylen);
+	if(!p || !record_valid(h, p + sizeof(h))) { return NULL; }
+	return p;
+}
+
+
+// scans the records in [begin, limit) of a vector file
+struct ostorage::scan_worker {
+	scan_worker(ostorage* self, volume* vol,
+			vecoff_t begin, vecoff_t limit, bool resync);
+
+	void operator() ();
+	void scan();
+
+	struct entry {
+		uint64_t clocktime;
+		uint32_t seq;
+		vecoff_t off;  // address of the body
+		uint32_t size;
+		uint32_t bcrc;
+		bool has_bcrc;
+		bool removed;
+		bool chunked;
+		std::string body;  // inline body
+	};
+	typedef std::map<std::string, entry> entries_t;
+
+	static void merge(entries_t& to, const std::string& key, const entry& e);
+
+	ostorage* self;
+	volume* vol;
+	vecoff_t begin;
+	vecoff_t limit;
+	bool resync;  // begin may be inside a record
+
+	vecoff_t first;     // first record scanned
+	vecoff_t stop;      // first record at or after limit
+	vecoff_t last_end;  // end of the last record
+	uint32_t last_seq;  // largest seq of the records
+	entries_t entries;
+	std::string error;
+
+private:
+	vecoff_t find_record(scanner& sc, vecoff_t off);
+};
+
+ostorage::scan_worker::scan_worker(ostorage* s, volume* v,
+		vecoff_t b, vecoff_t l, bool r) :
+	self(s), vol(v), begin(b), limit(l), resync(r),
+	first(b), stop(b), last_end(0), last_seq(0) { }
+
+void ostorage::scan_worker::operator() ()
+try {
+	scan();
+} catch (std::exception& e) {
+	error = e.what();
+} catch (...) {
+	error = "unknown error";
+}
+
+ostorage::vecoff_t ostorage::scan_worker::find_record(scanner& sc, vecoff_t off)
+{
+	for(; off < limit; off += 8) {
+		if(sc.load_record(off)) { return off; }
+	}
+	return limit;
+}
+
+void ostorage::scan_worker::merge(entries_t& to,
+		const std::string& key, const entry& e)
+{
+	std::pair<entries_t::iterator, bool> ins =
+		to.insert(entries_t::value_type(key, e));
+	if(ins.second) { return; }
+
+	// newer clocktime wins; the later record if they are the same.
+	// records without seq are ordered by their offsets.
+	entry& old(ins.first->second);
+	ClockTime ct(e.clocktime);
+	ClockTime oldct(old.clocktime);
+	int32_t later = e.seq - old.seq;
+	if(ct > oldct || (ct == oldct &&
+				(later > 0 || (later == 0 && e.off > old.off)))) {
+		old = e;
+	}
+}
+
+void ostorage::scan_worker::scan()
+{
+	scanner sc(vol->fd, vol->size);
+
+	vecoff_t off = resync ? find_record(sc, begin) : begin;
+	first = off;
+
+	while(off < limit) {
+		const char* p = sc.load_record(off);
+		if(!p) {
+			// torn or never written; skip to the next record
+			off = find_record(sc, off + 8);
+			continue;
+		}
+
+		record_header h;
+		memcpy(&h, p, sizeof(h));
+
+		if(last_end == 0 || (int32_t)(h.seq - last_seq) > 0) {
+			last_seq = h.seq;
+		}
+
+		int state = h.flags & RECORD_STATE_MASK;
+		if(state != RECORD_PENDING && !(h.flags & RECORD_CHUNK)) {
+			entry e;
+			e.clocktime = h.clocktime;
+			e.seq = h.seq;
+			e.off = vol->base | (off + sizeof(h) + h.keylen);
+			e.size = h.size;
+			e.bcrc = h.bcrc;
+			e.has_bcrc = (h.flags & RECORD_BCRC) != 0;
+			e.removed = (state == RECORD_REMOVED);
+			e.chunked = (h.flags & RECORD_MANIFEST) != 0;
+			if(!e.removed && e.has_bcrc && h.size <= self->m_inline_size) {
+				const char* b = sc.load(off, sizeof(h) + h.keylen + h.size);
+				if(b) {
+					p = b;
+					e.body.assign(b + sizeof(h) + h.keylen, h.size);
+				}
+			}
+			merge(entries, std::string(p + sizeof(h), h.keylen), e);
+		}
+
+		off += record_size(h.keylen, h.size);
+		last_end = off;
+	}
+
+	stop = off;
+}
+
+
+size_t ostorage::rebuild_index(size_t threads)
+{
+	if(threads == 0) { threads = 1; }
+
+	// the vector files are scanned in parallel, each by its share
+	// of the threads
+	size_t share = std::max(threads / m_volumes.size(), (size_t)1);
+
+	std::vector<scan_worker> workers;
+	for(size_t v=0; v < m_volumes.size(); ++v) {
+		volume* vol = m_volumes[v];
+		vecoff_t begin = vol->records_begin;
+		vecoff_t end = std::max(vol->size, begin);
+
+		size_t n = share;
+		while(n > 1 && (end - begin) / n < RECOVER_MIN_RANGE) {
+			--n;
+		}
+		vecoff_t range = ((end - begin) / n) & ~(vecoff_t)7;
+
+		for(size_t i=0; i < n; ++i) {
+			vecoff_t b = begin + range * i;
+			vecoff_t l = (i == n-1) ? end : b + range;
+			workers.push_back(scan_worker(this, vol, b, l, i > 0));
+		}
+	}
+
+	std::vector<mp::pthread_thread*> running;
+	try {
+		for(size_t i=1; i < workers.size(); ++i) {
+			running.push_back(NULL);
+			running.back() = new mp::pthread_thread(&workers[i]);
+			running.back()->run();
+		}
+	} catch (...) {
+		for(size_t i=0; i < running.size(); ++i) {
+			if(running[i]) {
+				running[i]->join();
+				delete running[i];
+			}
+		}
+		throw;
+	}
+
+	workers[0]();
+
+	for(size_t i=0; i < running.size(); ++i) {
+		running[i]->join();
+		delete running[i];
+	}
+
+	// a thread may have started inside a record of its predecessor;
+	// its range is scanned again from where the predecessor stopped
+	scan_worker::entries_t entries;
+	std::vector<vecoff_t> used(m_volumes.size());
+	for(size_t v=0; v < m_volumes.size(); ++v) {
+		used[v] = m_volumes[v]->records_begin;
+	}
+	for(size_t i=0; i < workers.size(); ++i) {
+		scan_worker& w(workers[i]);
+		bool head = i == 0 || workers[i-1].vol != w.vol;
+		vecoff_t expect = head ? w.begin : workers[i-1].stop;
+		if(w.error.empty() && w.first != expect) {
+			w.entries.clear();
+			w.begin = expect;
+			w.resync = false;
+			w();
+		}
+		if(!w.error.empty()) {
+			throw std::runtime_error("can't scan vector: " + w.error);
+		}
+
+		for(scan_worker::entries_t::iterator it(w.entries.begin()),
+				it_end(w.entries.end()); it != it_end; ++it) {
+			scan_worker::merge(entries, it->first, it->second);
+		}
+		w.entries.clear();
+
+		used[w.vol->id] = std::max(used[w.vol->id], w.last_end);
+		if(w.last_end) { raise_seq(w.last_seq); }
+	}
+
+	if(!tchdbvanish(m_index_map)) {
+		throw std::runtime_error("can't clear index");
+	}
+
+	for(scan_worker::entries_t::iterator it(entries.begin()),
+			it_end(entries.end()); it != it_end; ++it) {
+		const scan_worker::entry& e(it->second);
+		char mem[INDEX_VALUE_SIZE + INDEX_INLINE_LIMIT];
+		*(uint32_t*)mem                 = ClockTime(e.clocktime).time();  // FIXME endian
+		*(uint32_t*)(((char*)mem) + 4)  = e.removed ? 0 : e.size;         // FIXME endian
+		*(vecoff_t*)(((char*)mem) + 8)  = e.removed ? 0 :
+			e.off | (e.chunked ? INDEX_CHUNKED : 0);                      // FIXME endian
+		*(uint32_t*)(((char*)mem) + 16) = e.bcrc;                         // FIXME endian
+		size_t len = (!e.removed && e.has_bcrc) ? INDEX_VALUE_SIZE : 16;
+		if(!e.body.empty()) {
+			memcpy(mem + INDEX_VALUE_SIZE, e.body.data(), e.body.size());
+			len += e.body.size();
+		}
+		if(!tchdbput(m_index_map,
+				it->first.data(), it->first.size(),
+				mem, len)) {
+			throw std::runtime_error("can't rebuild index");
+		}
+	}
+
+	vecoff_t bytes = 0;
+	for(size_t v=0; v < m_volumes.size(); ++v) {
+		volume* vol = m_volumes[v];
+		if(*vol->used < used[v]) {
+			*vol->used = used[v];
+		}
+		bytes += used[v] - vol->records_begin;
+	}
+
+	sync_index();
+
+	std::cout << "index rebuilt: " << entries.size() << " keys, "
+		<< bytes << " bytes of records" << std::endl;
+
+	return entries.size();
+}
+
+void ostorage::rebuild_key_index()
+{
+	if(!tcbdbvanish(m_key_map) || !tcbdbtranbegin(m_key_map)) {
+		throw std::runtime_error("can't clear key index");
+	}
+
+	size_t keys = 0;
+	tchdbiterinit(m_index_map);
+	int klen;
+	while(void* key = tchdbiternext(m_index_map, &klen)) {
+		int memlen;
+		void* mem = tchdbget(m_index_map, key, klen, &memlen);
+		bool removed = !mem || memlen < 16 ||
+			*(vecoff_t*)(((char*)mem) + 8) == 0;     // FIXME endian
+		::free(mem);
+
+		bool ok = removed || tcbdbputkeep(m_key_map, key, klen, "", 0);
+		::free(key);
+		if(!ok) {
+			tcbdbtranabort(m_key_map);
+			throw std::runtime_error("can't rebuild key index");
+		}
+		if(!removed) { ++keys; }
+	}
+
+	if(!tcbdbtrancommit(m_key_map)) {
+		throw std::runtime_error("can't rebuild key index");
+	}
+
+	std::cout << "key index rebuilt: " << keys << " keys" << std::endl;
+}
+
+// the used offset may lag behind the records written before a crash.
+// records behind a torn one are skipped to, not overwritten.
+void ostorage::scan_tail(volume* vol)
+{
+	vecoff_t off = std::max((vecoff_t)*vol->used, vol->records_begin);
+
+	scan_worker w(this, vol, off, vol->size, false);
+	w.scan();
+
+	if(*vol->used < w.last_end) {
+		*vol->used = w.last_end;
+	}
+	if(w.last_end) { raise_seq(w.last_seq); }
+}
+
+
+bool ostorage::verify(block* bk)
+{
+	if(!bk->has_crc()) { return true; }
+
+	if(bk->is_chunked()) {
+		chunks_t chunks;
+		chunks_of(bk, &chunks);
+		for(chunks_t::iterator it(chunks.begin()), it_end(chunks.end());
+				it != it_end; ++it) {
+			if(!verify_extent(it->off, it->size, it->crc)) { return false; }
+		}
+		return true;
+	}
+
+	if(bk->data()) {
+		return crc32c(0, bk->data(), bk->size()) == bk->crc();
+	}
+
+	return verify_extent(bk->address(), bk->size(), bk->crc());
+}
+
+bool ostorage::verify_extent(vecoff_t addr, uint32_t size, uint32_t expect)
+{
+	volume* vol = volume_of(addr);
+	if(!vol) { return false; }
+	vecoff_t off = offset_of(addr);
+
+	size_t bufsz = std::min((size_t)size, (size_t)VERIFY_READ_SIZE);
+	char* buf = (char*)::malloc(bufsz ? bufsz : 1);
+	if(!buf) { throw std::bad_alloc(); }
+
+	uint32_t crc = 0;
+	size_t rest = size;
+	while(rest > 0) {
+		ssize_t rl = ::pread(vol->fd, buf, std::min(rest, bufsz), off);
+		if(rl <= 0) {
+			if(rl < 0 && errno == EINTR) { continue; }
+			int err = errno;
+			::free(buf);
+			if(rl == 0) { return false; }
+			throw mp::system_error(err, "can't read vector");
+		}
+		crc = crc32c(crc, buf, rl);
+		off += rl;
+		rest -= rl;
+	}
+
+	::free(buf);
+	return crc == expect;
+}
+
+bool ostorage::is_current(const std::string& key, vecoff_t addr)
+{
+	mp::pthread_scoped_lock lslk(m_leases_mutex);
+	leases_t::iterator it = m_leases.find(key);
+	if(it != m_leases.end()) {
+		block* bk = it->second.bk;
+		return bk && !bk->is_free_block && bk->address() == addr;
+	}
+
+	int memlen;
+	void* mem = tchdbget(m_index_map, key.data(), key.size(), &memlen);
+	if(!mem) { return false; }
+	bool current = memlen >= 16 &&
+		(*(vecoff_t*)(((char*)mem) + 8) & ~INDEX_CHUNKED) == addr;  // FIXME endian
+	::free(mem);
+	return current;
+}
+
+
+// walks the records and verifies the bodies the index refers to,
+// reading at most rate bytes per second
+class ostorage::scrubber {
+public:
+	scrubber(ostorage* self, uint64_t rate);
+	~scrubber();
+
+	void operator() ();
+
+private:
+	void scrub();
+
+	// false if stopped
+	bool scrub_volume(volume* vol, uint64_t* objects, uint64_t* corrupted);
+
+	// false if stopped
+	bool verify_body(scanner& sc, vecoff_t off, const record_header& h, bool* ok);
+
+	// sleeps until the bytes read are within the rate.
+	// false if stopped.
+	bool throttle(uint64_t bytes);
+	bool wait_until(const struct timeval& tv);
+
+	ostorage* m_self;
+	uint64_t m_rate;
+
+	struct timeval m_start;
+	uint64_t m_bytes;
+
+	mp::pthread_mutex m_mutex;
+	mp::pthread_cond m_cond;
+	volatile bool m_stop;
+
+	mp::pthread_thread m_thread;
+
+private:
+	scrubber();
+	scrubber(const scrubber&);
+};
+
+ostorage::scrubber::scrubber(ostorage* self, uint64_t rate) :
+	m_self(self), m_rate(rate), m_bytes(0),
+	m_stop(false), m_thread(this)
+{
+	m_thread.run();
+}
+
+ostorage::scrubber::~scrubber()
+{
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		m_stop = true;
+		m_cond.signal();
+	}
+	m_thread.join();
+}
+
+void ostorage::scrubber::operator() ()
+{
+	while(true) {
+		try {
+			scrub();
+		} catch (std::exception& e) {
+			std::cerr << "scrub: " << e.what() << std::endl;
+		}
+
+		struct timeval next;
+		gettimeofday(&next, NULL);
+		next.tv_sec += SCRUB_INTERVAL;
+		if(!wait_until(next)) { return; }
+	}
+}
+
+void ostorage::scrubber::scrub()
+{
+	gettimeofday(&m_start, NULL);
+	m_bytes = 0;
+
+	uint64_t objects = 0;
+	uint64_t corrupted = 0;
+
+	for(size_t i=0; i < m_self->m_volumes.size(); ++i) {
+		if(!scrub_volume(m_self->m_volumes[i], &objects, &corrupted)) {
+			return;
+		}
+	}
+
+	std::cout << "scrub: " << objects << " objects verified, "
+		<< corrupted << " corrupted" << std::endl;
+}
+
+bool ostorage::scrubber::scrub_volume(volume* vol,
+		uint64_t* objects, uint64_t* corrupted)
+{
+	vecoff_t off = vol->records_begin;
+	vecoff_t end = *vol->used;
+	scanner sc(vol->fd, end);
+
+	while(off < end) {
+		const char* p = sc.load_record(off);
+		if(!p) {
+			off += 8;
+			continue;
+		}
+
+		record_header h;
+		memcpy(&h, p, sizeof(h));
+		vecoff_t body = off + sizeof(h) + h.keylen;
+
+		if((h.flags & RECORD_STATE_MASK) != RECORD_COMMITTED ||
+				!(h.flags & RECORD_BCRC)) {
+			if(!throttle(body - off)) { return false; }
+			off += record_size(h.keylen, h.size);
+			continue;
+		}
+
+		// chunks are only referred by chunk lists
+		std::string key(p + sizeof(h), h.keylen);
+		if((h.flags & RECORD_CHUNK) || m_self->is_current(key, vol->base | body)) {
+			bool ok;
+			if(!verify_body(sc, body, h, &ok)) { return false; }
+			if(!ok) {
+				std::cerr << "scrub: checksum mismatch of " << key
+					<< " at " << (vol->base | body) << std::endl;
+				++*corrupted;
+			}
+			++*objects;
+		} else if(!throttle(body - off)) {
+			return false;
+		}
+
+		off += record_size(h.keylen, h.size);
+	}
+
+	return true;
+}
+
+bool ostorage::scrubber::verify_body(scanner& sc, vecoff_t off,
+		const record_header& h, bool* ok)
+{
+	uint32_t crc = 0;
+	size_t rest = h.size;
+	while(rest > 0) {
+		size_t n = std::min(rest, (size_t)RECOVER_READ_SIZE);
+		const char* p = sc.load(off, n);
+		if(!p) { break; }
+		crc = crc32c(crc, p, n);
+		off += n;
+		rest -= n;
+		if(!throttle(n)) { return false; }
+	}
+	*ok = rest == 0 && crc == h.bcrc;
+	return true;
+}
+
+bool ostorage::scrubber::throttle(uint64_t bytes)
+{
+	m_bytes += bytes;
+
+	uint64_t usec = m_bytes * 1000000 / m_rate;
+	struct timeval tv = m_start;
+	tv.tv_sec  += usec / 1000000;
+	tv.tv_usec += usec % 1000000;
+	if(tv.tv_usec >= 1000000) {
+		++tv.tv_sec;
+		tv.tv_usec -= 1000000;
+	}
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	if(timercmp(&now, &tv, >=)) {
+		return !m_stop;
+	}
+	return wait_until(tv);
+}
+
+bool ostorage::scrubber::wait_until(const struct timeval& tv)
+{
+	struct timespec abstime;
+	abstime.tv_sec  = tv.tv_sec;
+	abstime.tv_nsec = tv.tv_usec * 1000;
+
+	mp::pthread_scoped_lock lk(m_mutex);
+	while(!m_stop) {
+		if(!m_cond.timedwait(m_mutex, &abstime)) { break; }
+	}
+	return !m_stop;
+}
+
+
+void ostorage::start_scrubber(uint64_t rate)
+{
+	m_scrubber = new scrubber(this, rate);
+}
+
+void ostorage::stop_scrubber()
+{
+	delete m_scrubber;
+	m_scrubber = NULL;
+}
+
+
+}  // namespace kastor
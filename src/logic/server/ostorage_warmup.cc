@@ -0,0 +1,365 @@
+//
+// Kastor
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "ostorage.h"
+#include <mp/pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+// keys saved for the warmup
+#ifndef HOT_KEYS_LIMIT
+#define HOT_KEYS_LIMIT 100000
+#endif
+
+// leases copied under one lock while saving the keys
+#ifndef HOT_KEYS_BATCH
+#define HOT_KEYS_BATCH 4096
+#endif
+
+// bytes prefetched from the head of a large body
+#ifndef WARMUP_OBJECT_BYTES
+#define WARMUP_OBJECT_BYTES (16*1024*1024)
+#endif
+
+namespace kastor {
+
+
+// saves the keys every interval seconds and once more when stopped
+class ostorage::hot_keys_saver {
+public:
+	hot_keys_saver(ostorage* self, uint32_t interval);
+	~hot_keys_saver();
+
+	void operator() ();
+
+private:
+	// false if stopped
+	bool wait(uint32_t sec);
+
+	ostorage* m_self;
+	uint32_t m_interval;
+
+	mp::pthread_mutex m_mutex;
+	mp::pthread_cond m_cond;
+	volatile bool m_stop;
+
+	mp::pthread_thread m_thread;
+
+private:
+	hot_keys_saver();
+	hot_keys_saver(const hot_keys_saver&);
+};
+
+ostorage::hot_keys_saver::hot_keys_saver(ostorage* self, uint32_t interval) :
+	m_self(self), m_interval(interval),
+	m_stop(false), m_thread(this)
+{
+	m_thread.run();
+}
+
+ostorage::hot_keys_saver::~hot_keys_saver()
+{
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+		m_stop = true;
+		m_cond.signal();
+	}
+	m_thread.join();
+}
+
+void ostorage::hot_keys_saver::operator() ()
+{
+	bool stopped = false;
+	while(!stopped) {
+		stopped = !wait(m_interval);
+		try {
+			m_self->save_hot_keys();
+		} catch (std::exception& e) {
+			std::cerr << "hot keys: " << e.what() << std::endl;
+		}
+	}
+}
+
+bool ostorage::hot_keys_saver::wait(uint32_t sec)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	struct timespec abstime;
+	abstime.tv_sec  = now.tv_sec + sec;
+	abstime.tv_nsec = now.tv_usec * 1000;
+
+	mp::pthread_scoped_lock lk(m_mutex);
+	while(!m_stop) {
+		if(!m_cond.timedwait(m_mutex, &abstime)) { break; }
+	}
+	return !m_stop;
+}
+
+
+void ostorage::start_hot_keys_saver(uint32_t interval)
+{
+	m_hot_keys_saver = new hot_keys_saver(this, interval);
+}
+
+void ostorage::stop_hot_keys_saver()
+{
+	delete m_hot_keys_saver;
+	m_hot_keys_saver = NULL;
+}
+
+
+namespace {
+	typedef std::pair<uint64_t, std::string> hot_key_t;
+
+	struct hotter {
+		bool operator() (const hot_key_t& x, const hot_key_t& y) const
+		{
+			return x.first > y.first;
+		}
+	};
+
+	void keep_hottest(std::vector<hot_key_t>* keys, size_t limit)
+	{
+		if(keys->size() > limit) {
+			std::nth_element(keys->begin(), keys->begin() + limit,
+					keys->end(), hotter());
+			keys->resize(limit);
+		}
+	}
+}
+
+// one key per line, most recently read first
+void ostorage::save_hot_keys()
+{
+	std::vector<hot_key_t> keys;
+
+	// copied in batches so that reads don't wait for all of them
+	std::string last;
+	bool more = true;
+	for(bool first = true; more; first = false) {
+		mp::pthread_scoped_lock lslk(m_leases_mutex);
+		leases_t::iterator it = first ? m_leases.begin() : m_leases.upper_bound(last);
+		for(size_t n=0; n < HOT_KEYS_BATCH && it != m_leases.end(); ++n, ++it) {
+			const lease_entry& e(it->second);
+			if(e.used && e.bk && !e.bk->is_free_block) {
+				keys.push_back(hot_key_t(e.used, it->first));
+			}
+			last = it->first;
+		}
+		more = it != m_leases.end();
+		lslk.unlock();
+
+		if(keys.size() >= HOT_KEYS_LIMIT * 2) {
+			keep_hottest(&keys, HOT_KEYS_LIMIT);
+		}
+	}
+
+	keep_hottest(&keys, HOT_KEYS_LIMIT);
+	std::sort(keys.begin(), keys.end(), hotter());
+
+	std::string tmp = m_hot_keys_path + ".tmp";
+	{
+		std::ofstream f(tmp.c_str(), std::ios::out | std::ios::trunc);
+		for(std::vector<hot_key_t>::iterator it(keys.begin()), it_end(keys.end());
+				it != it_end; ++it) {
+			f << it->second << '\n';
+		}
+		f.close();
+		if(!f) {
+			::unlink(tmp.c_str());
+			throw std::runtime_error("can't write " + tmp);
+		}
+	}
+	if(::rename(tmp.c_str(), m_hot_keys_path.c_str()) < 0) {
+		int err = errno;
+		::unlink(tmp.c_str());
+		throw mp::system_error(err, "can't rename " + tmp);
+	}
+}
+
+
+// reads every step-th key from begin
+struct ostorage::warmup_worker {
+	warmup_worker(ostorage* self, const std::vector<std::string>* keys,
+			size_t begin, size_t step);
+
+	void operator() ();
+
+	ostorage* self;
+	const std::vector<std::string>* keys;
+	size_t begin;
+	size_t step;
+
+	size_t found;
+	uint64_t bytes;
+	size_t errors;
+	std::string error;  // the first one
+};
+
+ostorage::warmup_worker::warmup_worker(ostorage* s,
+		const std::vector<std::string>* k, size_t b, size_t st) :
+	self(s), keys(k), begin(b), step(st), found(0), bytes(0), errors(0) { }
+
+void ostorage::warmup_worker::operator() ()
+{
+	for(size_t i=begin; i < keys->size(); i += step) {
+		try {
+			scoped_block bk(self->read((*keys)[i]));
+			if(!bk) { continue; }
+			++found;
+			bytes += self->prefetch(bk.get());
+		} catch (std::exception& e) {
+			if(errors++ == 0) { error = (*keys)[i] + ": " + e.what(); }
+		}
+	}
+}
+
+uint64_t ostorage::prefetch(block* bk)
+{
+	if(bk->is_chunked()) {
+		chunks_t chunks;
+		chunks_of(bk, &chunks);
+		uint64_t bytes = 0;
+		for(chunks_t::iterator it(chunks.begin()), it_end(chunks.end());
+				it != it_end && bytes < (uint64_t)WARMUP_OBJECT_BYTES; ++it) {
+			uint32_t len = std::min((uint64_t)it->size,
+					(uint64_t)WARMUP_OBJECT_BYTES - bytes);
+			::posix_fadvise(fd_of(it->off), offset_of(it->off), len,
+					POSIX_FADV_WILLNEED);
+			bytes += len;
+		}
+		return bytes;
+	}
+
+	// inline bodies came with the index
+	if(bk->data()) { return 0; }
+
+	bool corrupt;
+	object_cache::body* cached = read_body(bk, &corrupt);
+	if(cached) {
+		object_cache::release(cached);
+		return bk->size();
+	}
+
+	uint32_t len = std::min(bk->size(), (uint32_t)WARMUP_OBJECT_BYTES);
+	::posix_fadvise(bk->fd(), bk->offset(), len, POSIX_FADV_WILLNEED);
+	return len;
+}
+
+// the leases of the saved keys are made before any request, with the
+// index pages and the bodies they touch
+size_t ostorage::warmup(const std::string& index_path, size_t threads,
+		uint64_t index_bytes)
+{
+	std::vector<std::string> keys;
+	{
+		std::ifstream f(m_hot_keys_path.c_str());
+		std::string line;
+		while(keys.size() < HOT_KEYS_LIMIT && std::getline(f, line)) {
+			if(!line.empty()) { keys.push_back(line); }
+		}
+	}
+	if(keys.empty()) { return 0; }
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	// the lookups are serialized by the leases; the head of the
+	// index, where its buckets are, is read ahead meanwhile
+	if(index_bytes) {
+		int ifd = ::open(index_path.c_str(), O_RDONLY);
+		if(ifd >= 0) {
+			::posix_fadvise(ifd, 0, index_bytes, POSIX_FADV_WILLNEED);
+			::close(ifd);
+		}
+	}
+
+	threads = std::min(threads, keys.size());
+	std::vector<warmup_worker> workers;
+	for(size_t i=0; i < threads; ++i) {
+		workers.push_back(warmup_worker(this, &keys, i, threads));
+	}
+
+	std::vector<mp::pthread_thread*> running;
+	try {
+		for(size_t i=1; i < workers.size(); ++i) {
+			running.push_back(NULL);
+			running.back() = new mp::pthread_thread(&workers[i]);
+			running.back()->run();
+		}
+	} catch (...) {
+		for(size_t i=0; i < running.size(); ++i) {
+			if(running[i]) {
+				running[i]->join();
+				delete running[i];
+			}
+		}
+		throw;
+	}
+
+	workers[0]();
+
+	for(size_t i=0; i < running.size(); ++i) {
+		running[i]->join();
+		delete running[i];
+	}
+
+	// the reads ticked the leases hottest first; the saved ranking
+	// is restored so that restarts don't reverse it
+	{
+		mp::pthread_scoped_lock lslk(m_leases_mutex);
+		for(size_t i=keys.size(); i > 0; --i) {
+			leases_t::iterator it = m_leases.find(keys[i-1]);
+			if(it != m_leases.end() && it->second.bk) {
+				it->second.used = ++m_lease_tick;
+			}
+		}
+	}
+
+	// a key that can't be read is left for the requests
+	size_t found = 0;
+	uint64_t bytes = 0;
+	for(size_t i=0; i < workers.size(); ++i) {
+		if(workers[i].errors) {
+			std::cerr << "warmup: " << workers[i].errors << " keys failed; "
+				<< workers[i].error << std::endl;
+		}
+		found += workers[i].found;
+		bytes += workers[i].bytes;
+	}
+
+	struct timeval end;
+	gettimeofday(&end, NULL);
+	uint64_t msec = (end.tv_sec - start.tv_sec) * 1000 +
+		(end.tv_usec - start.tv_usec) / 1000;
+
+	std::cout << "warmup: " << found << " of " << keys.size() << " keys, "
+		<< bytes << " bytes prefetched in " << msec << " msec" << std::endl;
+
+	return found;
+}
+
+
+}  // namespace kastor
+
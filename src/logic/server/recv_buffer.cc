@@ -0,0 +1,97 @@
+//
+// Kastor
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "server/recv_buffer.h"
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+namespace kastor {
+
+
+// free RECV_BUFFER_SIZE buffers of this thread, linked through the first word.
+// a buffer is usually returned by the thread that borrowed it.
+static __thread char* s_pool = NULL;
+static __thread size_t s_pool_num = 0;
+
+char* recv_buffer::acquire()
+{
+	if(s_pool) {
+		char* buf = s_pool;
+		s_pool = *(char**)buf;
+		--s_pool_num;
+		return buf;
+	}
+	char* buf = (char*)::malloc(RECV_BUFFER_SIZE);
+	if(!buf) { throw std::bad_alloc(); }
+	return buf;
+}
+
+void recv_buffer::release(char* buf, size_t size)
+{
+	if(size == RECV_BUFFER_SIZE && s_pool_num < RECV_BUFFER_POOL_LIMIT) {
+		*(char**)buf = s_pool;
+		s_pool = buf;
+		++s_pool_num;
+		return;
+	}
+	::free(buf);
+}
+
+void recv_buffer::reserve_buffer(size_t len)
+{
+	if(!m_buffer) {
+		if(len <= RECV_BUFFER_SIZE) {
+			m_buffer = acquire();
+			m_size = RECV_BUFFER_SIZE;
+			return;
+		}
+		m_buffer = (char*)::malloc(len);
+		if(!m_buffer) { throw std::bad_alloc(); }
+		m_size = len;
+		return;
+	}
+
+	if(m_used == m_off) {
+		// rewind buffer
+		m_used = 0;
+		m_off = 0;
+	}
+	if(m_size - m_used >= len) { return; }
+
+	size_t not_used = m_used - m_off;
+	if(m_size >= not_used + len) {
+		::memmove(m_buffer, m_buffer + m_off, not_used);
+	} else {
+		size_t next_size = m_size * 2;
+		while(next_size < not_used + len) { next_size *= 2; }
+
+		char* tmp = (char*)::malloc(next_size);
+		if(!tmp) { throw std::bad_alloc(); }
+		memcpy(tmp, m_buffer + m_off, not_used);
+
+		release(m_buffer, m_size);
+		m_buffer = tmp;
+		m_size = next_size;
+	}
+	m_used = not_used;
+	m_off = 0;
+}
+
+
+}  // namespace kastor
+
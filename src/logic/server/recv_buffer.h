@@ -0,0 +1,123 @@
+//
+// Kastor
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef RECV_BUFFER_H__
+#define RECV_BUFFER_H__
+
+#include <stddef.h>
+
+#ifndef RECV_BUFFER_SIZE
+#define RECV_BUFFER_SIZE 8*1024
+#endif
+
+#ifndef RECV_BUFFER_POOL_LIMIT
+#define RECV_BUFFER_POOL_LIMIT 64
+#endif
+
+namespace kastor {
+
+
+// Receive buffer borrowed from a per-thread pool while a request is
+// in flight. An idle connection holds no memory.
+class recv_buffer {
+public:
+	recv_buffer();
+	~recv_buffer();
+
+public:
+	// borrows a buffer if none is held
+	void reserve_buffer(size_t len);
+
+	void* buffer();
+	size_t buffer_capacity() const;
+	void buffer_consumed(size_t len);
+
+	void* data();
+	size_t data_size() const;
+	void data_used(size_t len);
+
+	// returns the buffer to the pool if all data is used
+	void recycle();
+
+private:
+	char* m_buffer;
+	size_t m_size;
+	size_t m_used;
+	size_t m_off;
+
+	static char* acquire();
+	static void release(char* buf, size_t size);
+
+private:
+	recv_buffer(const recv_buffer&);
+};
+
+
+inline recv_buffer::recv_buffer() :
+	m_buffer(NULL), m_size(0), m_used(0), m_off(0) { }
+
+inline recv_buffer::~recv_buffer()
+{
+	if(m_buffer) { release(m_buffer, m_size); }
+}
+
+inline void* recv_buffer::buffer()
+{
+	return m_buffer + m_used;
+}
+
+inline size_t recv_buffer::buffer_capacity() const
+{
+	return m_size - m_used;
+}
+
+inline void recv_buffer::buffer_consumed(size_t len)
+{
+	m_used += len;
+}
+
+inline void* recv_buffer::data()
+{
+	return m_buffer + m_off;
+}
+
+inline size_t recv_buffer::data_size() const
+{
+	return m_used - m_off;
+}
+
+inline void recv_buffer::data_used(size_t len)
+{
+	m_off += len;
+}
+
+inline void recv_buffer::recycle()
+{
+	if(m_buffer && m_used == m_off) {
+		release(m_buffer, m_size);
+		m_buffer = NULL;
+		m_size = 0;
+		m_used = 0;
+		m_off = 0;
+	}
+}
+
+
+}  // namespace kastor
+
+#endif /* recv_buffer.h */
+
@@ -43,6 +43,9 @@ struct pthread_thread {
 	void* join();
 	void cancel();
 
+	// pins the running thread to the cpu. no-op except on Linux.
+	void set_affinity(int cpu);
+
 	bool operator== (const pthread_thread& other) const;
 	bool operator!= (const pthread_thread& other) const;
 
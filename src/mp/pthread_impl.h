@@ -63,6 +63,17 @@ inline void pthread_thread::cancel()
 	pthread_cancel(m_thread);
 }
 
+inline void pthread_thread::set_affinity(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	int err = pthread_setaffinity_np(m_thread, sizeof(set), &set);
+	if(err) { throw pthread_error(err, "failed to set thread affinity"); }
+#endif
+}
+
 inline bool pthread_thread::operator== (const pthread_thread& other) const
 {
 	return pthread_equal(m_thread, other.m_thread);
@@ -31,6 +31,7 @@
 #include <errno.h>
 #include <memory>
 #include <queue>
+#include <vector>
 
 namespace mp {
 namespace wavy {
@@ -41,8 +42,14 @@ public:
 	core();
 	~core();
 
+	// 0 selects the compile-time default
+	core(size_t backlog_size, size_t task_queue_limit);
+
 	void add_thread(size_t num);
 
+	// i-th new thread is pinned to cpus[i % cpus.size()]
+	void add_thread(size_t num, const std::vector<int>& cpus);
+
 	void end();
 	bool is_end() const;
 
@@ -83,6 +90,12 @@ public:
 	void timer(const timespec* interval, timer_callback_t callback);
 
 
+	// stop re-arming read events of fd after the running one;
+	// resume_read() re-arms it
+	void pause_read(int fd);
+	void resume_read(int fd);
+
+
 	template <typename Handler>
 	Handler* add(int fd);
 MP_ARGS_BEGIN
@@ -32,6 +32,11 @@
 #include <errno.h>
 #include <memory>
 #include <queue>
+#include <vector>
+
+#ifndef MP_WAVY_XFER_INLINE_SIZE
+#define MP_WAVY_XFER_INLINE_SIZE 128
+#endif
 
 namespace mp {
 namespace wavy {
@@ -42,8 +47,21 @@ public:
 	net();
 	~net();
 
+	// 0 selects the compile-time default
+	net(size_t backlog_size, size_t task_queue_limit);
+
 	void add_thread(size_t num);
 
+	// i-th new thread is pinned to cpus[i % cpus.size()]
+	void add_thread(size_t num, const std::vector<int>& cpus);
+
+	// pause(sock) is called when more than high bytes are queued for
+	// the socket and resume(sock) when the queue drains to low bytes.
+	// 0 selects the compile-time default. Call this before add_thread().
+	typedef function<void (int sock)> backpressure_callback_t;
+	void set_backpressure(size_t high, size_t low,
+			backpressure_callback_t pause, backpressure_callback_t resume);
+
 	void end();
 	bool is_end() const;
 
@@ -78,6 +96,30 @@ public:
 
 	void send(int sock, xfer* xf);
 
+	struct send_stat {
+		uint64_t bytes;        // bytes written to the socket
+		uint64_t active_usec;  // time spent with data queued
+	};
+
+	// counters are kept per descriptor; reset them when
+	// a new connection is assigned to the descriptor
+	send_stat get_send_stat(int sock);
+	void reset_send_stat(int sock);
+
+	// iovs of at least min_bytes are sent with MSG_ZEROCOPY where
+	// supported; their finalizers run after the kernel releases the
+	// buffers. 0 disables it (default). Call this before add_thread().
+	void set_zerocopy(size_t min_bytes);
+
+	// xfer buffers that outgrow the inline buffer are taken from
+	// a process-wide pool and returned to it when drained
+	struct alloc_stat {
+		uint64_t heap;    // buffers allocated from the heap
+		uint64_t pooled;  // buffers reused from the pool
+		uint64_t freed;   // buffers returned to the heap
+	};
+	static alloc_stat get_alloc_stat();
+
 /*
 	template <typename F>
 	void submit(F f);
@@ -120,6 +162,9 @@ public:
 public:
 	bool empty() const;
 
+	// bytes of iov and file data not sent yet
+	size_t bytes() const;
+
 	void reset();
 
 	void migrate(xfer* target);
@@ -145,20 +190,28 @@ protected:
 	char* m_head;
 	char* m_tail;
 	size_t m_free;
+	size_t m_bytes;
 
 	void reserve(size_t reqsz);
 
+	// drops the entries and returns a pooled buffer
+	void discard();
+
+	// the common one to three entries fit without allocation
+	char m_inline[MP_WAVY_XFER_INLINE_SIZE];
+
 private:
 	xfer(const xfer&);
 };
 
 
 inline net::xfer::xfer() :
-	m_head(NULL), m_tail(NULL), m_free(0) { }
+	m_head(m_inline), m_tail(m_inline),
+	m_free(MP_WAVY_XFER_INLINE_SIZE), m_bytes(0) { }
 
 inline net::xfer::~xfer()
 {
-	if(m_head) { reset(); }
+	reset();
 }
 
 inline bool net::xfer::empty() const
@@ -166,6 +219,11 @@ inline bool net::xfer::empty() const
 	return m_head == m_tail;
 }
 
+inline size_t net::xfer::bytes() const
+{
+	return m_bytes;
+}
+
 template <typename T>
 inline void net::xfer::push_finalize(std::auto_ptr<T>& fin)
 {
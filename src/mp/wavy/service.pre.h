@@ -35,9 +35,15 @@ struct service {
 
 	static void init(size_t rthreads = 0, size_t wthreads = 0);
 
+	static void init(size_t rthreads, size_t wthreads,
+			size_t backlog_size, size_t task_queue_limit);
+
 	static void add_rthread(size_t num);
 	static void add_wthread(size_t num);
 
+	static void add_rthread(size_t num, const std::vector<int>& cpus);
+	static void add_wthread(size_t num, const std::vector<int>& cpus);
+
 	static void join();
 	static void detach();
 	static void end();
@@ -81,6 +87,15 @@ struct service {
 
 	static void send(int sock, xfer* xf);
 
+	typedef net::send_stat send_stat;
+	static send_stat get_send_stat(int sock);
+	static void reset_send_stat(int sock);
+
+	static void set_zerocopy(size_t min_bytes);
+
+	typedef net::alloc_stat alloc_stat;
+	static alloc_stat get_alloc_stat();
+
 
 	template <typename Handler>
 	static Handler* add(int fd);
@@ -100,6 +115,8 @@ private:
 	static core* s_core;
 	static net* s_net;
 
+	static void init_backpressure();
+
 	service();
 };
 
@@ -115,10 +132,31 @@ void service<Instance>::init(size_t rthreads, size_t wthreads)
 {
 	s_core = new core();
 	s_net = new net();
+	init_backpressure();
+	add_rthread(rthreads);
+	add_wthread(wthreads);
+}
+
+template <typename Instance>
+void service<Instance>::init(size_t rthreads, size_t wthreads,
+		size_t backlog_size, size_t task_queue_limit)
+{
+	s_core = new core(backlog_size, task_queue_limit);
+	s_net = new net(backlog_size, task_queue_limit);
+	init_backpressure();
 	add_rthread(rthreads);
 	add_wthread(wthreads);
 }
 
+template <typename Instance>
+void service<Instance>::init_backpressure()
+{
+	// stop reading requests from peers that don't read responses
+	s_net->set_backpressure(0, 0,
+			bind(&core::pause_read, s_core, placeholders::_1),
+			bind(&core::resume_read, s_core, placeholders::_1));
+}
+
 template <typename Instance>
 void service<Instance>::add_rthread(size_t num)
 	{ s_core->add_thread(num); }
@@ -127,6 +165,14 @@ template <typename Instance>
 void service<Instance>::add_wthread(size_t num)
 	{ s_net->add_thread(num); }
 
+template <typename Instance>
+void service<Instance>::add_rthread(size_t num, const std::vector<int>& cpus)
+	{ s_core->add_thread(num, cpus); }
+
+template <typename Instance>
+void service<Instance>::add_wthread(size_t num, const std::vector<int>& cpus)
+	{ s_net->add_thread(num, cpus); }
+
 template <typename Instance>
 void service<Instance>::join()
 {
@@ -208,6 +254,22 @@ template <typename Instance>
 inline void service<Instance>::send(int sock, xfer* xf)
 	{ s_net->send(sock, xf); }
 
+template <typename Instance>
+inline net::send_stat service<Instance>::get_send_stat(int sock)
+	{ return s_net->get_send_stat(sock); }
+
+template <typename Instance>
+inline void service<Instance>::reset_send_stat(int sock)
+	{ s_net->reset_send_stat(sock); }
+
+template <typename Instance>
+inline void service<Instance>::set_zerocopy(size_t min_bytes)
+	{ s_net->set_zerocopy(min_bytes); }
+
+template <typename Instance>
+inline net::alloc_stat service<Instance>::get_alloc_stat()
+	{ return net::get_alloc_stat(); }
+
 
 
 template <typename Instance>
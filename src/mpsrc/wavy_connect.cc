@@ -18,126 +18,164 @@
 
 #include "wavy_core.h"
 #include <fcntl.h>
-#include <poll.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 namespace mp {
 namespace wavy {
 
 
-class core::impl::connect_thread {
-public:
-	struct pack {
-		int        socket_family;
-		int        socket_type;
-		int        protocol;
-		socklen_t  addrlen;
-		int        timeout_msec;
-		core*      c;
-		sockaddr   addr[0];
-	};
-
-	connect_thread(core* c,
-			int socket_family, int socket_type, int protocol,
-			const sockaddr* addr, socklen_t addrlen,
-			int timeout_msec, connect_callback_t& callback) :
-		m((pack*)::malloc(sizeof(pack)+addrlen)),
-		m_callback(callback)
-	{
-		if(!m) { throw std::bad_alloc(); }
-		m->socket_family = socket_family;
-		m->socket_type   = socket_type;
-		m->protocol      = protocol;
-		m->addrlen       = addrlen;
-		m->timeout_msec  = timeout_msec;
-		m->c             = c;
-		::memcpy(m->addr, addr, addrlen);
+static inline uint64_t connect_now_msec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+void core::connect(int socket_family, int socket_type, int protocol,
+		const sockaddr* addr, socklen_t addrlen,
+		int timeout_msec, connect_callback_t callback)
+{
+	m_impl->connect(socket_family, socket_type, protocol,
+			addr, addrlen, timeout_msec, callback);
+}
+
+void core::impl::connect(int socket_family, int socket_type, int protocol,
+		const sockaddr* addr, socklen_t addrlen,
+		int timeout_msec, connect_callback_t& callback)
+{
+	int err = 0;
+	int fd = ::socket(socket_family, socket_type, protocol);
+	if(fd < 0) {
+		err = errno;
+		goto out;
+	}
+
+	if(::fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+		goto errno_error;
+	}
+
+	if(::connect(fd, addr, addrlen) >= 0) {
+		// connect success
+		goto out;
+	}
+
+	if(errno != EINPROGRESS) {
+		goto errno_error;
 	}
 
-	void operator() ()
 	{
-		int err = 0;
-		int fd = ::socket(m->socket_family, m->socket_type, m->protocol);
-		if(fd < 0) {
-			err = errno;
-			goto out;
+		// the poller completes the connection on EVEDGE_WRITE
+		// or when the deadline expires.
+		pthread_scoped_lock lk(m_mutex);
+
+		connecting_t::iterator it = m_connecting.insert(
+				connecting_t::value_type(fd, pending_connect())).first;
+		it->second.callback = callback;
+		it->second.deadline = m_connect_deadlines.end();
+		if(timeout_msec >= 0) {
+			it->second.deadline = m_connect_deadlines.insert(
+					connect_deadlines_t::value_type(
+						connect_now_msec() + timeout_msec, fd));
 		}
 
-		if(::fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
-			goto errno_error;
+		if(m_edge.add_notify(fd, EVEDGE_WRITE) < 0) {
+			err = errno;
+			if(it->second.deadline != m_connect_deadlines.end()) {
+				m_connect_deadlines.erase(it->second.deadline);
+			}
+			m_connecting.erase(it);
+			lk.unlock();
+			goto specific_error;
 		}
 
-		if(::connect(fd, m->addr, m->addrlen) >= 0) {
-			// connect success
-			goto out;
+		if(timeout_msec >= 0 && !m_pollable) {
+			// let the poller pick up the new deadline
+			m_edge.wakeup();
 		}
+		return;
+	}
 
-		if(errno != EINPROGRESS) {
-			goto errno_error;
-		}
+errno_error:
+	err = errno;
 
-		while(true) {
-			struct pollfd pf = {fd, POLLOUT, 0};
-			int ret = ::poll(&pf, 1, m->timeout_msec);
-			if(ret < 0) {
-				if(errno == EINTR) { continue; }
-				goto errno_error;
-			}
+specific_error:
+	::close(fd);
+	fd = -1;
 
-			if(ret == 0) {
-				errno = ETIMEDOUT;
-				goto specific_error;
-			}
+out:
+	task_t t(bind(callback, fd, err));
+	submit_impl(t);
+}
 
-			{
-				int value = 0;
-				int len = sizeof(value);
-				if(::getsockopt(fd, SOL_SOCKET, SO_ERROR,
-						&value, (socklen_t*)&len) < 0) {
-					goto errno_error;
-				}
-				if(value != 0) {
-					err = value;
-					goto specific_error;
-				}
-				goto out;
-			}
-		}
 
-	errno_error:
-		err = errno;
+// called by the poller with m_mutex locked
+int core::impl::connect_timeout()
+{
+	if(m_connect_deadlines.empty()) { return -1; }
 
-	specific_error:
-		::close(fd);
-		fd = -1;
+	uint64_t now = connect_now_msec();
+	uint64_t deadline = m_connect_deadlines.begin()->first;
+	if(deadline <= now) { return 0; }
+	if(deadline - now > INT_MAX) { return INT_MAX; }
+	return deadline - now;
+}
 
-	out:
-		try {
-			m->c->submit(m_callback, fd, err);
-		} catch (...) {
-			::free(m);
-			throw;
+// called by the poller with m_mutex locked.
+// removes completed connections from the backlog and
+// returns the number of remaining events.
+int core::impl::connect_event(int num)
+{
+	for(int i=0; i < num; ) {
+		connecting_t::iterator it = m_connecting.find(m_backlog[i]);
+		if(it == m_connecting.end()) {
+			++i;
+			continue;
 		}
 
-		::free(m);
-		return;
+		int value = 0;
+		socklen_t len = sizeof(value);
+		if(::getsockopt(it->first, SOL_SOCKET, SO_ERROR,
+				&value, &len) < 0) {
+			value = errno;
+		}
+		connect_finish(it, value);
+
+		num = m_backlog.erase(i, num);
 	}
 
-private:
-	pack* m;
-	connect_callback_t m_callback;
-};
+	if(!m_connect_deadlines.empty()) {
+		uint64_t now = connect_now_msec();
+		while(!m_connect_deadlines.empty() &&
+				m_connect_deadlines.begin()->first <= now) {
+			connect_finish(
+					m_connecting.find(m_connect_deadlines.begin()->second),
+					ETIMEDOUT);
+		}
+	}
 
+	return num;
+}
 
-void core::connect(int socket_family, int socket_type, int protocol,
-		const sockaddr* addr, socklen_t addrlen,
-		int timeout_msec, connect_callback_t callback)
+void core::impl::connect_finish(connecting_t::iterator it, int err)
 {
-	impl::connect_thread t(this,
-			socket_family, socket_type, protocol,
-			addr, addrlen, timeout_msec, callback);
-	submit(t);
+	int fd = it->first;
+	m_edge.remove(fd, EVEDGE_WRITE);  // ignore error
+
+	if(it->second.deadline != m_connect_deadlines.end()) {
+		m_connect_deadlines.erase(it->second.deadline);
+	}
+
+	if(err) {
+		::close(fd);
+		fd = -1;
+	}
+
+	m_task_queue.push(bind(it->second.callback, fd, err));
+	m_connecting.erase(it);
 }
 
 
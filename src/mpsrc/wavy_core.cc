@@ -20,7 +20,6 @@
 #include "mp/object_callback.h"
 #include "mp/utility.h"
 #include <sys/types.h>
-#include <sys/resource.h>
 #include <unistd.h>
 
 #ifndef MP_WAVY_TASK_QUEUE_LIMIT
@@ -31,20 +30,20 @@ namespace mp {
 namespace wavy {
 
 
-core::core() : m_impl(new impl()) { }
+core::core() : m_impl(new impl(0, 0)) { }
 
-core::impl::impl() :
+core::core(size_t backlog_size, size_t task_queue_limit) :
+	m_impl(new impl(backlog_size, task_queue_limit)) { }
+
+core::impl::impl(size_t backlog_size, size_t task_queue_limit) :
 	m_off(0),
 	m_num(0),
 	m_pollable(true),
-	m_end_flag(false)
-{
-	struct rlimit rbuf;
-	if(::getrlimit(RLIMIT_NOFILE, &rbuf) < 0) {
-		throw system_error(errno, "getrlimit() failed");
-	}
-	m_state = new shared_handler[rbuf.rlim_cur];
-}
+	m_idle(0),
+	m_backlog(backlog_size),
+	m_end_flag(false),
+	m_task_queue_limit(task_queue_limit ?
+			task_queue_limit : MP_WAVY_TASK_QUEUE_LIMIT) { }
 
 
 core::~core() { }
@@ -60,7 +59,10 @@ core::impl::~impl()
 			it != m_workers.end(); ++it) {
 		delete *it;
 	}
-	delete[] m_state;
+	for(connecting_t::iterator it(m_connecting.begin());
+			it != m_connecting.end(); ++it) {
+		::close(it->first);
+	}
 }
 
 
@@ -72,6 +74,7 @@ void core::impl::end()
 		pthread_scoped_lock lk(m_mutex);
 		m_cond.broadcast();
 	}
+	m_edge.wakeup();
 }
 
 bool core::is_end() const { return m_impl->is_end(); }
@@ -98,8 +101,11 @@ void core::impl::detach()
 	}
 }
 
-void core::add_thread(size_t num) { m_impl->add_thread(num); }
-void core::impl::add_thread(size_t num)
+void core::add_thread(size_t num)
+	{ m_impl->add_thread(num, std::vector<int>()); }
+void core::add_thread(size_t num, const std::vector<int>& cpus)
+	{ m_impl->add_thread(num, cpus); }
+void core::impl::add_thread(size_t num, const std::vector<int>& cpus)
 {
 	for(size_t i=0; i < num; ++i) {
 		m_workers.push_back(NULL);
@@ -110,6 +116,9 @@ void core::impl::add_thread(size_t num)
 			throw;
 		}
 		m_workers.back()->run();
+		if(!cpus.empty()) {
+			m_workers.back()->set_affinity(cpus[i % cpus.size()]);
+		}
 	}
 }
 
@@ -119,11 +128,36 @@ void core::impl::submit_impl(task_t& f)
 	pthread_scoped_lock lk(m_mutex);
 	m_task_queue.push(f);
 	m_cond.signal();
+	if(m_idle == 0 && !m_pollable) {
+		// no thread is waiting for tasks; interrupt the poller
+		m_edge.wakeup();
+	}
 }
 void core::submit_impl(task_t f)
 	{ m_impl->submit_impl(f); }
 
 
+void core::pause_read(int fd)
+	{ m_impl->pause_read(fd); }
+void core::impl::pause_read(int fd)
+{
+	__sync_bool_compare_and_swap(&m_read_state[fd], READ_ACTIVE, READ_PAUSING);
+}
+
+void core::resume_read(int fd)
+	{ m_impl->resume_read(fd); }
+void core::impl::resume_read(int fd)
+{
+	if(__sync_bool_compare_and_swap(&m_read_state[fd], READ_PAUSING, READ_ACTIVE)) {
+		// the running read event re-arms it
+		return;
+	}
+	if(__sync_bool_compare_and_swap(&m_read_state[fd], READ_PAUSED, READ_ACTIVE)) {
+		m_edge.shot_reactivate(fd, EVEDGE_READ);
+	}
+}
+
+
 void core::impl::add_impl(int fd, handler* newh)
 {
 	try {
@@ -132,6 +166,7 @@ void core::impl::add_impl(int fd, handler* newh)
 		delete newh;
 		throw;
 	}
+	m_read_state[fd] = READ_ACTIVE;
 	m_state[fd].reset(newh);
 	newh->m_shared_self = &m_state[fd];
 	m_edge.add_notify(fd, EVEDGE_READ);
@@ -146,7 +181,8 @@ void core::impl::operator() ()
 	while(true) {
 		pthread_scoped_lock lk(m_mutex);
 
-		while(m_task_queue.size() > MP_WAVY_TASK_QUEUE_LIMIT || !m_pollable) {
+		while(m_task_queue.size() > m_task_queue_limit || !m_pollable ||
+				(m_num == m_off && !m_task_queue.empty())) {
 			if(m_end_flag) { return; }
 
 			if(!m_task_queue.empty()) {
@@ -160,33 +196,40 @@ void core::impl::operator() ()
 				goto retry;
 			}
 
+			++m_idle;
 			m_cond.wait(m_mutex);
+			--m_idle;
 		}
 
 		if(m_num == m_off) {
 			m_pollable = false;
+			int timeout_msec = connect_timeout();
 			lk.unlock();
 
 		retry_poll:
 			if(m_end_flag) { return; }
 
-			int num = m_edge.wait(&m_backlog, 1000);
+			int num = m_edge.wait(&m_backlog, timeout_msec);
 			if(num < 0) {
 				if(errno == EINTR || errno == EAGAIN) {
 					goto retry_poll;
 				} else {
 					throw system_error(errno, "wavy core event failed");
 				}
-			} else if(num == 0) {
-				goto retry_poll;
 			}
 
 			lk.relock(m_mutex);
+			if(!m_connecting.empty()) {
+				num = connect_event(num);
+			}
 			m_off = 0;
 			m_num = num;
 
 			m_pollable = true;
 			m_cond.signal();
+
+			// woken up by submit(), connect() or end()
+			if(num == 0) { continue; }
 		}
 
 		int fd = m_backlog[m_off];
@@ -197,11 +240,17 @@ void core::impl::operator() ()
 			m_state[fd]->read_event();
 		} catch (...) {
 			m_edge.shot_remove(fd, EVEDGE_READ);
+			m_read_state[fd] = READ_ACTIVE;
 			m_state[fd]->m_shared_self = NULL;
 			m_state[fd].reset();
 			goto retry;
 		}
 
+		if(__sync_bool_compare_and_swap(&m_read_state[fd], READ_PAUSING, READ_PAUSED)) {
+			// resume_read() re-arms it
+			goto retry;
+		}
+
 		m_edge.shot_reactivate(fd, EVEDGE_READ);
 	}
 }
@@ -22,6 +22,8 @@
 #include "mp/wavy/core.h"
 #include "mp/pthread.h"
 #include "wavy_edge.h"
+#include "wavy_fdtable.h"
+#include <map>
 
 namespace mp {
 namespace wavy {
@@ -29,11 +31,11 @@ namespace wavy {
 
 class core::impl {
 public:
-	impl();
+	impl(size_t backlog_size, size_t task_queue_limit);
 	~impl();
 
 public:
-	void add_thread(size_t num);
+	void add_thread(size_t num, const std::vector<int>& cpus);
 
 	void end();
 	bool is_end() const;
@@ -41,16 +43,21 @@ public:
 	void join();
 	void detach();
 
-	class connect_thread;
+	void connect(int socket_family, int socket_type, int protocol,
+			const sockaddr* addr, socklen_t addrlen,
+			int timeout_msec, connect_callback_t& callback);
 
 	class listen_handler;
 	void listen(int lsock, listen_callback_t callback);
 
 	class timer_thread;
 
+	void pause_read(int fd);
+	void resume_read(int fd);
+
 public:
 	inline void add_impl(int fd, handler* newh);
-	inline void submit_impl(task_t& f);
+	void submit_impl(task_t& f);
 
 public:
 	void operator() ();
@@ -59,11 +66,19 @@ private:
 	volatile size_t m_off;
 	volatile size_t m_num;
 	volatile bool m_pollable;
+	volatile size_t m_idle;
 
 	edge::backlog m_backlog;
 
 	typedef shared_ptr<handler> shared_handler;
-	shared_handler* m_state;
+	fdtable<shared_handler> m_state;
+
+	enum read_state_t {
+		READ_ACTIVE,   // initial state of a new table entry
+		READ_PAUSING,  // pause_read() called; not re-armed yet
+		READ_PAUSED,
+	};
+	fdtable<volatile int> m_read_state;
 
 	edge m_edge;
 
@@ -74,6 +89,22 @@ private:
 
 	typedef std::queue<task_t> task_queue_t;
 	task_queue_t m_task_queue;
+	const size_t m_task_queue_limit;
+
+	// in-progress connections; guarded by m_mutex
+	typedef std::multimap<uint64_t, int> connect_deadlines_t;
+	connect_deadlines_t m_connect_deadlines;
+
+	struct pending_connect {
+		connect_callback_t callback;
+		connect_deadlines_t::iterator deadline;
+	};
+	typedef std::map<int, pending_connect> connecting_t;
+	connecting_t m_connecting;
+
+	int connect_timeout();
+	int connect_event(int num);
+	void connect_finish(connecting_t::iterator it, int err);
 
 private:
 	typedef std::vector<pthread_thread*> workers_t;
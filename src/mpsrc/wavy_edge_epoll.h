@@ -23,7 +23,11 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 
 namespace mp {
 namespace wavy {
@@ -31,6 +35,7 @@ namespace wavy {
 
 static const short EVEDGE_READ  = EPOLLIN;
 static const short EVEDGE_WRITE = EPOLLOUT;
+static const short EVEDGE_ERROR = 0;  // EPOLLERR is always reported
 
 
 class edge {
@@ -40,13 +45,42 @@ public:
 		if(m_ep < 0) {
 			throw system_error(errno, "failed to initialize epoll");
 		}
+
+		m_wakeup = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		if(m_wakeup < 0) {
+			int err = errno;
+			::close(m_ep);
+			throw system_error(err, "failed to initialize eventfd");
+		}
+
+		struct epoll_event ev;
+		::memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;  // level-triggered, never rearmed
+		ev.data.fd = m_wakeup;
+		if(epoll_ctl(m_ep, EPOLL_CTL_ADD, m_wakeup, &ev) < 0) {
+			int err = errno;
+			::close(m_wakeup);
+			::close(m_ep);
+			throw system_error(err, "failed to register eventfd");
+		}
 	}
 
 	~edge()
 	{
+		::close(m_wakeup);
 		::close(m_ep);
 	}
 
+	// interrupts a thread blocking in wait().
+	// wait() returns without reporting the wakeup event.
+	void wakeup()
+	{
+		uint64_t one = 1;
+		if(::write(m_wakeup, &one, sizeof(one)) < 0) {
+			// EAGAIN: counter is already signaled
+		}
+	}
+
 	int add_notify(int fd, short event)
 	{
 		struct epoll_event ev;
@@ -76,11 +110,12 @@ public:
 	}
 
 	struct backlog {
-		backlog()
+		backlog(size_t num = MP_WAVY_EDGE_BACKLOG_SIZE) :
+			size(num ? num : MP_WAVY_EDGE_BACKLOG_SIZE)
 		{
 			buf = (struct epoll_event*)::calloc(
 					sizeof(struct epoll_event),
-					MP_WAVY_EDGE_BACKLOG_SIZE);
+					size);
 			if(!buf) { throw std::bad_alloc(); }
 		}
 
@@ -94,8 +129,17 @@ public:
 			return buf[n].data.fd;
 		}
 
+		// replaces the nth event with the last one.
+		// returns the new number of events.
+		int erase(int n, int num)
+		{
+			buf[n] = buf[num-1];
+			return num-1;
+		}
+
 	private:
 		struct epoll_event* buf;
+		size_t size;
 		friend class edge;
 		backlog(const backlog&);
 	};
@@ -107,12 +151,24 @@ public:
 
 	int wait(backlog* result, int timeout_msec)
 	{
-		return epoll_wait(m_ep, result->buf,
-				MP_WAVY_EDGE_BACKLOG_SIZE, timeout_msec);
+		int num = epoll_wait(m_ep, result->buf,
+				result->size, timeout_msec);
+		for(int i=0; i < num; ++i) {
+			if(result->buf[i].data.fd == m_wakeup) {
+				uint64_t count;
+				if(::read(m_wakeup, &count, sizeof(count)) < 0) {
+					// EAGAIN: drained by another thread
+				}
+				result->buf[i] = result->buf[--num];
+				break;
+			}
+		}
+		return num;
 	}
 
 private:
 	int m_ep;
+	int m_wakeup;
 
 private:
 	edge(const edge&);
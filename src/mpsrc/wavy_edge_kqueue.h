@@ -24,6 +24,8 @@
 #include <sys/types.h>
 #include <sys/event.h>
 #include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace mp {
 namespace wavy {
@@ -40,13 +42,43 @@ public:
 		if(m_kq < 0) {
 			throw system_error(errno, "failed to initialize kqueue");
 		}
+
+		if(::pipe(m_wakeup) < 0) {
+			int err = errno;
+			::close(m_kq);
+			throw system_error(err, "failed to initialize wakeup pipe");
+		}
+
+		struct kevent kev;
+		EV_SET(&kev, m_wakeup[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+		if(::fcntl(m_wakeup[0], F_SETFL, O_NONBLOCK) < 0 ||
+				::fcntl(m_wakeup[1], F_SETFL, O_NONBLOCK) < 0 ||
+				kevent(m_kq, &kev, 1, NULL, 0, NULL) < 0) {
+			int err = errno;
+			::close(m_wakeup[0]);
+			::close(m_wakeup[1]);
+			::close(m_kq);
+			throw system_error(err, "failed to register wakeup pipe");
+		}
 	}
 
 	~edge()
 	{
+		::close(m_wakeup[0]);
+		::close(m_wakeup[1]);
 		::close(m_kq);
 	}
 
+	// interrupts a thread blocking in wait().
+	// wait() returns without reporting the wakeup event.
+	void wakeup()
+	{
+		char one = 1;
+		if(::write(m_wakeup[1], &one, 1) < 0) {
+			// EAGAIN: pipe is already signaled
+		}
+	}
+
 	int add_notify(int fd, short event)
 	{
 		struct kevent kev;
@@ -70,11 +102,12 @@ public:
 	}
 
 	struct backlog {
-		backlog()
+		backlog(size_t num = MP_WAVY_EDGE_BACKLOG_SIZE) :
+			size(num ? num : MP_WAVY_EDGE_BACKLOG_SIZE)
 		{
 			buf = (struct kevent*)::calloc(
 					sizeof(struct kevent),
-					MP_WAVY_EDGE_BACKLOG_SIZE);
+					size);
 			if(!buf) { throw std::bad_alloc(); }
 		}
 
@@ -88,29 +121,56 @@ public:
 			return buf[n].ident;
 		}
 
+		// replaces the nth event with the last one.
+		// returns the new number of events.
+		int erase(int n, int num)
+		{
+			buf[n] = buf[num-1];
+			return num-1;
+		}
+
 	private:
 		struct kevent* buf;
+		size_t size;
 		friend class edge;
 		backlog(const backlog&);
 	};
 
 	int wait(backlog* result)
 	{
-		return kevent(m_kq, NULL, 0, result->buf,
-				MP_WAVY_EDGE_BACKLOG_SIZE, NULL);
+		int num = kevent(m_kq, NULL, 0, result->buf,
+				result->size, NULL);
+		return filter_wakeup(result, num);
 	}
 
 	int wait(backlog* result, int timeout_msec)
 	{
+		if(timeout_msec < 0) { return wait(result); }
 		struct timespec ts;
 		ts.tv_sec  = timeout_msec / 1000;
 		ts.tv_nsec = (timeout_msec % 1000) * 1000000;
-		return kevent(m_kq, NULL, 0, result->buf,
-				MP_WAVY_EDGE_BACKLOG_SIZE, &ts);
+		int num = kevent(m_kq, NULL, 0, result->buf,
+				result->size, &ts);
+		return filter_wakeup(result, num);
+	}
+
+private:
+	int filter_wakeup(backlog* result, int num)
+	{
+		for(int i=0; i < num; ++i) {
+			if((int)result->buf[i].ident == m_wakeup[0]) {
+				char buf[64];
+				while(::read(m_wakeup[0], buf, sizeof(buf)) > 0) { }
+				result->buf[i] = result->buf[--num];
+				break;
+			}
+		}
+		return num;
 	}
 
 private:
 	int m_kq;
+	int m_wakeup[2];
 
 private:
 	edge(const edge&);
@@ -0,0 +1,108 @@
+//
+// mp::wavy::fdtable
+//
+// Copyright (C) 2008-2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+
+#ifndef MP_WAVY_FDTABLE_H__
+#define MP_WAVY_FDTABLE_H__
+
+#include "mp/exception.h"
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifndef MP_WAVY_FDTABLE_CHUNK_SIZE
+#define MP_WAVY_FDTABLE_CHUNK_SIZE 256
+#endif
+
+namespace mp {
+namespace wavy {
+
+
+// Per-descriptor state covering RLIMIT_NOFILE descriptors.
+// Entries are allocated in chunks when a descriptor in the chunk is
+// first used, so memory follows the live descriptors instead of the
+// limit. Chunks stay until the table is destroyed; entries never move.
+// Lookups don't lock.
+template <typename T>
+class fdtable {
+public:
+	fdtable();
+	~fdtable();
+
+	// allocates the chunk of fd if needed
+	T& operator[] (int fd);
+
+private:
+	T* volatile* m_chunks;
+	size_t m_nchunks;
+
+	T* extend(size_t c);
+
+private:
+	fdtable(const fdtable&);
+};
+
+
+template <typename T>
+fdtable<T>::fdtable()
+{
+	struct rlimit rbuf;
+	if(::getrlimit(RLIMIT_NOFILE, &rbuf) < 0) {
+		throw system_error(errno, "getrlimit() failed");
+	}
+	m_nchunks = (rbuf.rlim_cur + MP_WAVY_FDTABLE_CHUNK_SIZE - 1) /
+		MP_WAVY_FDTABLE_CHUNK_SIZE;
+	m_chunks = (T* volatile*)::calloc(m_nchunks, sizeof(T*));
+	if(!m_chunks) { throw std::bad_alloc(); }
+}
+
+template <typename T>
+fdtable<T>::~fdtable()
+{
+	for(size_t c=0; c < m_nchunks; ++c) {
+		delete[] m_chunks[c];
+	}
+	::free((void*)m_chunks);
+}
+
+template <typename T>
+inline T& fdtable<T>::operator[] (int fd)
+{
+	size_t c = fd / MP_WAVY_FDTABLE_CHUNK_SIZE;
+	T* chunk = m_chunks[c];
+	if(!chunk) { chunk = extend(c); }
+	return chunk[fd % MP_WAVY_FDTABLE_CHUNK_SIZE];
+}
+
+template <typename T>
+T* fdtable<T>::extend(size_t c)
+{
+	T* chunk = new T[MP_WAVY_FDTABLE_CHUNK_SIZE]();
+	if(!__sync_bool_compare_and_swap(&m_chunks[c], (T*)NULL, chunk)) {
+		// another thread installed it first
+		delete[] chunk;
+	}
+	return m_chunks[c];
+}
+
+
+}  // namespace wavy
+}  // namespace mp
+
+#endif /* wavy_fdtable.h */
+
@@ -18,6 +18,11 @@
 
 #include "wavy_core.h"
 #include "mp/exception.h"
+#include <sys/socket.h>
+
+#ifndef MP_WAVY_ACCEPT_LIMIT
+#define MP_WAVY_ACCEPT_LIMIT 64
+#endif
 
 namespace mp {
 namespace wavy {
@@ -32,9 +37,14 @@ public:
 
 	void read_event()
 	{
-		while(true) {
+		// bounded so that a connection storm doesn't starve other handlers
+		for(int i=0; i < MP_WAVY_ACCEPT_LIMIT; ++i) {
 			int err = 0;
+#ifdef __linux__
+			int sock = ::accept4(fd(), NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
 			int sock = ::accept(fd(), NULL, NULL);
+#endif
 			if(sock < 0) {
 				if(errno == EAGAIN || errno == EINTR) {
 					return;
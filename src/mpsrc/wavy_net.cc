@@ -19,30 +19,76 @@
 #include "mp/wavy/net.h"
 #include "mp/pthread.h"
 #include "wavy_edge.h"
+#include "wavy_fdtable.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
-#include <sys/resource.h>
 #include <sys/uio.h>
 #include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <algorithm>
+#include <deque>
 
 #ifdef __linux__
 #include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#endif
+
+// Send an iov followed by a file with MSG_MORE so that the header and
+// the head of the body are coalesced into full segments; sendfile()
+// pushes the pending data when it completes.
+#if defined(MSG_MORE) && !defined(MP_WAVY_NET_NO_MSG_MORE)
+#define MP_WAVY_NET_MSG_MORE
+#endif
+
+// Large iovs may be sent with MSG_ZEROCOPY (see net::set_zerocopy).
+// Their finalizers run when the completion arrives on the error queue.
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && \
+	defined(SO_EE_ORIGIN_ZEROCOPY) && !defined(MP_WAVY_NET_NO_ZEROCOPY)
+#define MP_WAVY_NET_ZEROCOPY
 #endif
 
 #ifndef MP_WAVY_TASK_QUEUE_LIMIT
 #define MP_WAVY_TASK_QUEUE_LIMIT 16
 #endif
 
-/* FIXME
+// iovs passed to one writev()
 #ifndef MP_WAVY_WRITEV_LIMIT
-#define MP_WAVY_WRITEV_LIMIT 1024
+#ifdef IOV_MAX
+#define MP_WAVY_WRITEV_LIMIT ((size_t)IOV_MAX)
+#else
+#define MP_WAVY_WRITEV_LIMIT ((size_t)1024)
+#endif
 #endif
-*/
 
-//#ifndef MP_WAVY_WRITE_QUEUE_LIMIT
-//#define MP_WAVY_WRITE_QUEUE_LIMIT 32
-//#endif
+// bytes sent from files per write event; a connection with more data
+// waits for the next round so that other ready sockets are served
+#ifndef MP_WAVY_NET_WRITE_BUDGET
+#define MP_WAVY_NET_WRITE_BUDGET (512*1024)
+#endif
+
+// xfer buffers up to this size are kept for reuse when drained,
+// at most MP_WAVY_XFER_POOL_LIMIT of each size
+#ifndef MP_WAVY_XFER_POOL_MAX
+#define MP_WAVY_XFER_POOL_MAX (64*1024)
+#endif
+
+#ifndef MP_WAVY_XFER_POOL_LIMIT
+#define MP_WAVY_XFER_POOL_LIMIT 256
+#endif
+
+// reading from a connection is paused while more than HIGH_WATER bytes
+// are queued for it and resumed when the queue drains to LOW_WATER
+#ifndef MP_WAVY_NET_HIGH_WATER
+#define MP_WAVY_NET_HIGH_WATER (4*1024*1024)
+#endif
+
+#ifndef MP_WAVY_NET_LOW_WATER
+#define MP_WAVY_NET_LOW_WATER (1024*1024)
+#endif
 
 namespace mp {
 namespace wavy {
@@ -50,10 +96,13 @@ namespace wavy {
 
 class net::impl {
 public:
-	impl();
+	impl(size_t backlog_size, size_t task_queue_limit);
 	~impl();
 
-	void add_thread(size_t num);
+	void add_thread(size_t num, const std::vector<int>& cpus);
+
+	void set_backpressure(size_t high, size_t low,
+			backpressure_callback_t pause, backpressure_callback_t resume);
 
 	void end();
 	bool is_end() const;
@@ -87,6 +136,11 @@ public:
 
 	inline void submit_impl(task_t& f);
 
+	send_stat get_send_stat(int sock);
+	void reset_send_stat(int sock);
+
+	void set_zerocopy(size_t min_bytes);
+
 public:
 	void operator() ();
 
@@ -98,36 +152,106 @@ private:
 		~context();
 
 	public:
-		bool write_event(int fd);
-		bool try_write(int fd);
+		bool try_write(int fd, size_t zerocopy_min);
+
+		void reset();
 
 		pthread_mutex& mutex();
-#ifdef MP_WAVY_WRITE_QUEUE_LIMIT
-		void wait_cond();
-		size_t size();
+
+		void activate();
+		const send_stat& stat() const;
+		void reset_stat();
+
+		bool read_paused() const;
+		void set_read_paused(bool paused);
+
+		// IDLE -> DIRECT -> IDLE: send_direct() wrote everything
+		// IDLE -> DIRECT -> QUEUED: send_direct() queued the rest
+		// IDLE -> QUEUED -> IDLE: written through the queue
+		bool enter_direct();
+		void leave_direct();
+		void direct_to_queued();
+		bool enter_queued();
+		void leave_queued();
+		bool queued() const;
+
+		void add_sent(size_t bytes);
+
+#ifdef MP_WAVY_NET_ZEROCOPY
+		bool completion_waiting() const;
+		void reset_completion();
+#endif
+
+	private:
+		void finalize_entry(const xfer_finalize& x);
+		char* gather_iov(char* p, struct iovec* buf,
+				struct iovec** vec, size_t* veclen, size_t* total);
+		char* consume_iov(char* p, size_t wl);
+#ifdef MP_WAVY_NET_MSG_MORE
+		bool followed_by_file(const char* p) const;
+#endif
+#ifdef MP_WAVY_NET_ZEROCOPY
+		bool enable_zerocopy(int fd);
+		void defer_finalize(const xfer_finalize& x);
+		void reap_completion(int fd);
 #endif
 
 	private:
 		pthread_mutex m_mutex;
-#ifdef MP_WAVY_WRITE_QUEUE_LIMIT
-		pthread_cond m_cond;
-		volatile bool m_wait;
+		send_stat m_stat;
+		uint64_t m_active_since;
+		bool m_read_paused;
+
+		enum {
+			IDLE,
+			DIRECT,  // send_direct() is writing without the lock
+			QUEUED,  // the queue owns the socket; guarded by m_mutex
+		};
+		volatile int m_state;
+
+#ifdef MP_WAVY_NET_ZEROCOPY
+		// finalizers wait until m_zc_done reaches their id
+		struct deferred_finalize {
+			uint64_t id;
+			xfer_finalize fin;
+		};
+		std::deque<deferred_finalize> m_zc_deferred;
+		uint64_t m_zc_sent;
+		uint64_t m_zc_done;
+
+		// SO_ZEROCOPY is set once per socket
+		enum {
+			ZC_UNSET,
+			ZC_ENABLED,
+			ZC_FAILED,
+		};
+		int m_zc_state;
 #endif
 
 	private:
 		context(const context&);
 	};
 
+	bool write_event(context& ctx, int fd);
+	void write_done(context& ctx, int fd, bool registered);
 	void send_post(context& ctx, int fd, bool xempty);
+	void check_high_water(context& ctx, int fd);
+
+	bool lock_queue(context& ctx, pthread_scoped_lock& lk);
+	bool send_direct(context& ctx, int sock,
+			const struct iovec* vec, size_t veclen,
+			int fd, uint64_t offset, size_t count,
+			finalize_t fin, void* user);
 
 private:
 	volatile size_t m_off;
 	volatile size_t m_num;
 	volatile bool m_pollable;
+	volatile size_t m_idle;
 
 	edge::backlog m_backlog;
 
-	context* m_fdctx;
+	fdtable<context> m_fdctx;
 
 	edge m_edge;
 
@@ -136,8 +260,16 @@ private:
 
 	volatile bool m_end_flag;
 
+	size_t m_zerocopy_min;
+
+	size_t m_high_water;
+	size_t m_low_water;
+	backpressure_callback_t m_pause;
+	backpressure_callback_t m_resume;
+
 	typedef std::queue<task_t> task_queue_t;
 	task_queue_t m_task_queue;
+	const size_t m_task_queue_limit;
 
 private:
 	typedef std::vector<pthread_thread*> workers_t;
@@ -148,22 +280,146 @@ private:
 };
 
 
+// Free lists of xfer buffers by power-of-two size class.
+// Larger buffers go to the heap directly.
+class xfer_pool {
+public:
+	xfer_pool() { memset(&m_stat, 0, sizeof(m_stat)); }
+	~xfer_pool();
+
+	char* acquire(size_t* size);
+	void release(char* buf, size_t size);
+
+	net::alloc_stat stat() const;
+
+private:
+	static const size_t MIN_SHIFT = 8;  // 256 bytes
+	static const size_t NUM_CLASSES = 16;
+
+	static size_t class_of(size_t size);
+
+	struct freelist {
+		freelist() : head(NULL), num(0) { }
+		pthread_mutex mutex;
+		char* head;  // linked through the first word
+		size_t num;
+	};
+	freelist m_class[NUM_CLASSES];
+
+	net::alloc_stat m_stat;
+
+	xfer_pool(const xfer_pool&);
+};
+
+static xfer_pool s_xfer_pool;
+
+xfer_pool::~xfer_pool()
+{
+	for(size_t i=0; i < NUM_CLASSES; ++i) {
+		while(m_class[i].head) {
+			char* next = *(char**)m_class[i].head;
+			::free(m_class[i].head);
+			m_class[i].head = next;
+		}
+	}
+}
+
+inline size_t xfer_pool::class_of(size_t size)
+{
+	size_t c = 0;
+	while(((size_t)1 << (MIN_SHIFT + c)) < size) { ++c; }
+	return c;
+}
+
+char* xfer_pool::acquire(size_t* size)
+{
+	size_t c = class_of(*size);
+	size_t csize = (size_t)1 << (MIN_SHIFT + c);
+
+	if(c < NUM_CLASSES && csize <= MP_WAVY_XFER_POOL_MAX) {
+		*size = csize;
+		freelist& f(m_class[c]);
+		pthread_scoped_lock lk(f.mutex);
+		if(f.head) {
+			char* buf = f.head;
+			f.head = *(char**)buf;
+			--f.num;
+			lk.unlock();
+			__sync_add_and_fetch(&m_stat.pooled, 1);
+			return buf;
+		}
+	}
+
+	char* buf = (char*)::malloc(*size);
+	if(!buf) { throw std::bad_alloc(); }
+	__sync_add_and_fetch(&m_stat.heap, 1);
+	return buf;
+}
+
+void xfer_pool::release(char* buf, size_t size)
+{
+	size_t c = class_of(size);
+
+	if(c < NUM_CLASSES && ((size_t)1 << (MIN_SHIFT + c)) == size &&
+			size <= MP_WAVY_XFER_POOL_MAX) {
+		freelist& f(m_class[c]);
+		pthread_scoped_lock lk(f.mutex);
+		if(f.num < MP_WAVY_XFER_POOL_LIMIT) {
+			*(char**)buf = f.head;
+			f.head = buf;
+			++f.num;
+			return;
+		}
+	}
+
+	::free(buf);
+	__sync_add_and_fetch(&m_stat.freed, 1);
+}
+
+net::alloc_stat xfer_pool::stat() const
+{
+	net::alloc_stat st = m_stat;
+	return st;
+}
+
+net::alloc_stat net::get_alloc_stat()
+{
+	return s_xfer_pool.stat();
+}
+
+
 inline void net::xfer::reserve(size_t reqsz)
 {
 	size_t used = m_tail - m_head;
+	size_t capa = used + m_free;
 	reqsz += used;
-	size_t nsize = (used + m_free) * 2 + 72;  // used + m_free may be 0
+	size_t nsize = capa * 2;
 
 	while(nsize < reqsz) { nsize *= 2; }
 
-	char* tmp = (char*)::realloc(m_head, nsize);
-	if(!tmp) { throw std::bad_alloc(); }
+	char* tmp = s_xfer_pool.acquire(&nsize);
+	memcpy(tmp, m_head, used);
+
+	if(m_head != m_inline) {
+		s_xfer_pool.release(m_head, capa);
+	}
 
 	m_head = tmp;
 	m_tail = tmp + used;
 	m_free = nsize - used;
 }
 
+void net::xfer::discard()
+{
+	if(m_head != m_inline) {
+		s_xfer_pool.release(m_head, m_tail - m_head + m_free);
+		m_head = m_inline;
+	}
+	m_tail = m_head;
+	m_free = MP_WAVY_XFER_INLINE_SIZE;
+	m_bytes = 0;
+}
+
 void net::xfer::push_iov(const struct iovec* vec, size_t veclen)
 {
 	size_t vecbuflen = sizeof(struct iovec) * veclen;
@@ -180,6 +436,10 @@ void net::xfer::push_iov(const struct iovec* vec, size_t veclen)
 	m_tail += vecbuflen;
 
 	m_free -= reqsz;
+
+	for(size_t i=0; i < veclen; ++i) {
+		m_bytes += vec[i].iov_len;
+	}
 }
 
 void net::xfer::push_file(int fd, uint64_t off, size_t len)
@@ -196,11 +456,12 @@ void net::xfer::push_file(int fd, uint64_t off, size_t len)
 	m_tail += sizeof(xfer_file);
 
 	m_free -= reqsz;
+	m_bytes += len;
 }
 
 void net::xfer::push_finalize(void (*finalize)(void*), void* user)
 {
-	size_t reqsz = sizeof(xfer_file) + sizeof(xfer_type);
+	size_t reqsz = sizeof(xfer_finalize) + sizeof(xfer_type);
 	if(m_free < reqsz) { reserve(reqsz); }
 
 	xfer_finalize x = {finalize, user};
@@ -225,11 +486,9 @@ void net::xfer::migrate(xfer* target)
 
 	target->m_tail += reqsz;
 	target->m_free -= reqsz;
+	target->m_bytes += m_bytes;
 
-	::free(m_head);
-	m_head = NULL;
-	m_tail = NULL;
-	m_free = 0;
+	discard();
 }
 
 void net::xfer::reset()
@@ -261,26 +520,28 @@ void net::xfer::reset()
 		}
 	}
 
-	m_free += m_tail - m_head;
-	m_tail = m_head;
+	discard();
 }
 
 
 
-net::net() : m_impl(new impl()) { }
+net::net() : m_impl(new impl(0, 0)) { }
+
+net::net(size_t backlog_size, size_t task_queue_limit) :
+	m_impl(new impl(backlog_size, task_queue_limit)) { }
 
-net::impl::impl() :
+net::impl::impl(size_t backlog_size, size_t task_queue_limit) :
 	m_off(0),
 	m_num(0),
 	m_pollable(true),
-	m_end_flag(false)
-{
-	struct rlimit rbuf;
-	if(::getrlimit(RLIMIT_NOFILE, &rbuf) < 0) {
-		throw system_error(errno, "getrlimit() failed");
-	}
-	m_fdctx = new context[rbuf.rlim_cur];
-}
+	m_idle(0),
+	m_backlog(backlog_size),
+	m_end_flag(false),
+	m_zerocopy_min(0),
+	m_high_water(MP_WAVY_NET_HIGH_WATER),
+	m_low_water(MP_WAVY_NET_LOW_WATER),
+	m_task_queue_limit(task_queue_limit ?
+			task_queue_limit : MP_WAVY_TASK_QUEUE_LIMIT) { }
 
 
 net::~net() { }
@@ -296,7 +557,6 @@ net::impl::~impl()
 			it != m_workers.end(); ++it) {
 		delete *it;
 	}
-	delete[] m_fdctx;
 }
 
 
@@ -308,6 +568,7 @@ void net::impl::end()
 		pthread_scoped_lock lk(m_mutex);
 		m_cond.broadcast();
 	}
+	m_edge.wakeup();
 }
 
 bool net::is_end() const { return m_impl->is_end(); }
@@ -334,8 +595,11 @@ void net::impl::detach()
 	}
 }
 
-void net::add_thread(size_t num) { m_impl->add_thread(num); }
-void net::impl::add_thread(size_t num)
+void net::add_thread(size_t num)
+	{ m_impl->add_thread(num, std::vector<int>()); }
+void net::add_thread(size_t num, const std::vector<int>& cpus)
+	{ m_impl->add_thread(num, cpus); }
+void net::impl::add_thread(size_t num, const std::vector<int>& cpus)
 {
 	for(size_t i=0; i < num; ++i) {
 		m_workers.push_back(NULL);
@@ -346,25 +610,68 @@ void net::impl::add_thread(size_t num)
 			throw;
 		}
 		m_workers.back()->run();
+		if(!cpus.empty()) {
+			m_workers.back()->set_affinity(cpus[i % cpus.size()]);
+		}
 	}
 }
 
 
+void net::set_backpressure(size_t high, size_t low,
+		backpressure_callback_t pause, backpressure_callback_t resume)
+	{ m_impl->set_backpressure(high, low, pause, resume); }
+void net::impl::set_backpressure(size_t high, size_t low,
+		backpressure_callback_t pause, backpressure_callback_t resume)
+{
+	m_high_water = high ? high : MP_WAVY_NET_HIGH_WATER;
+	m_low_water  = low  ? low  : MP_WAVY_NET_LOW_WATER;
+	if(m_low_water > m_high_water) { m_low_water = m_high_water; }
+	m_pause = pause;
+	m_resume = resume;
+}
+
+
+void net::set_zerocopy(size_t min_bytes)
+	{ m_impl->set_zerocopy(min_bytes); }
+void net::impl::set_zerocopy(size_t min_bytes)
+{
+#ifdef MP_WAVY_NET_ZEROCOPY
+	m_zerocopy_min = min_bytes;
+#endif
+}
+
+
 void net::impl::submit_impl(task_t& f)
 {
 	pthread_scoped_lock lk(m_mutex);
 	m_task_queue.push(f);
 	m_cond.signal();
+	if(m_idle == 0 && !m_pollable) {
+		// no thread is waiting for tasks; interrupt the poller
+		m_edge.wakeup();
+	}
 }
 void net::submit_impl(task_t f)
 	{ m_impl->submit_impl(f); }
 
 
-net::impl::context::context()
-#ifdef MP_WAVY_WRITE_QUEUE_LIMIT
-	: m_wait(false)
+static inline uint64_t net_now_usec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+net::impl::context::context() :
+	m_active_since(0),
+	m_read_paused(false),
+	m_state(IDLE)
+#ifdef MP_WAVY_NET_ZEROCOPY
+	, m_zc_sent(0), m_zc_done(0), m_zc_state(ZC_UNSET)
 #endif
-	{ }
+{
+	reset_stat();
+}
 
 net::impl::context::~context() { }
 
@@ -373,43 +680,319 @@ inline pthread_mutex& net::impl::context::mutex()
 	return m_mutex;
 }
 
-#ifdef MP_WAVY_WRITE_QUEUE_LIMIT
-inline void net::impl::context::wait_cond()
+inline void net::impl::context::activate()
 {
-	m_wait = true;
-	m_cond.wait(m_mutex);
+	m_active_since = net_now_usec();
 }
 
-inline size_t net::impl::context::size() const
+inline const net::send_stat& net::impl::context::stat() const
 {
-	return m_tail - m_head;
+	return m_stat;
 }
+
+inline void net::impl::context::reset_stat()
+{
+	m_stat.bytes = 0;
+	m_stat.active_usec = 0;
+}
+
+inline void net::impl::context::reset()
+{
+#ifdef MP_WAVY_NET_ZEROCOPY
+	reset_completion();
 #endif
+	xfer::reset();
+}
 
-inline bool net::impl::context::write_event(int fd)
+inline bool net::impl::context::enter_direct()
 {
-	pthread_scoped_lock lk(m_mutex);
-	return try_write(fd);
+	return __sync_bool_compare_and_swap(&m_state, IDLE, DIRECT);
+}
+
+inline void net::impl::context::leave_direct()
+{
+	__sync_bool_compare_and_swap(&m_state, DIRECT, IDLE);
+}
+
+inline void net::impl::context::direct_to_queued()
+{
+	__sync_bool_compare_and_swap(&m_state, DIRECT, QUEUED);
+}
+
+inline bool net::impl::context::enter_queued()
+{
+	return __sync_bool_compare_and_swap(&m_state, IDLE, QUEUED);
+}
+
+inline void net::impl::context::leave_queued()
+{
+	__sync_bool_compare_and_swap(&m_state, QUEUED, IDLE);
+}
+
+inline bool net::impl::context::queued() const
+{
+	return m_state == QUEUED;
+}
+
+inline void net::impl::context::add_sent(size_t bytes)
+{
+	m_stat.bytes += bytes;
+}
+
+inline bool net::impl::context::read_paused() const
+{
+	return m_read_paused;
 }
 
+inline void net::impl::context::set_read_paused(bool paused)
+{
+	m_read_paused = paused;
+}
+
+#ifdef MP_WAVY_NET_ZEROCOPY
+inline bool net::impl::context::completion_waiting() const
+{
+	return !m_zc_deferred.empty();
+}
+
+void net::impl::context::reset_completion()
+{
+	// the socket is gone; nothing reads the buffers any more
+	while(!m_zc_deferred.empty()) {
+		xfer_finalize x = m_zc_deferred.front().fin;
+		m_zc_deferred.pop_front();
+		try {
+			x.finalize(x.user);
+		} catch (...) { }
+	}
+	m_zc_sent = 0;
+	m_zc_done = 0;
+	m_zc_state = ZC_UNSET;
+}
+
+inline bool net::impl::context::enable_zerocopy(int fd)
+{
+	if(m_zc_state == ZC_UNSET) {
+		int on = 1;
+		m_zc_state = ::setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0 ?
+			ZC_ENABLED : ZC_FAILED;
+	}
+	return m_zc_state == ZC_ENABLED;
+}
+
+inline void net::impl::context::defer_finalize(const xfer_finalize& x)
+{
+	deferred_finalize d = {m_zc_sent, x};
+	try {
+		m_zc_deferred.push_back(d);
+	} catch (...) {
+		try {
+			x.finalize(x.user);
+		} catch (...) { }
+	}
+}
+
+void net::impl::context::reap_completion(int fd)
+{
+	while(true) {
+		char control[128];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if(::recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+			break;  // EAGAIN: no more notifications
+		}
+
+		for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+				cm = CMSG_NXTHDR(&msg, cm)) {
+			if(!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+					!(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+				continue;
+			}
+			struct sock_extended_err* serr =
+				(struct sock_extended_err*)CMSG_DATA(cm);
+			if(serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) { continue; }
+			// sends [ee_info, ee_data] completed
+			m_zc_done += serr->ee_data - serr->ee_info + 1;
+		}
+	}
+
+	while(!m_zc_deferred.empty() && m_zc_deferred.front().id <= m_zc_done) {
+		xfer_finalize x = m_zc_deferred.front().fin;
+		m_zc_deferred.pop_front();
+		try {
+			x.finalize(x.user);
+		} catch (...) { }
+	}
+}
+#endif
+
 #define MPIO_NET_XFER_CONSUMED \
 	do { \
 		size_t trail = m_tail - p; \
 		::memmove(m_head, p, trail); \
 		m_tail = m_head + trail; \
+		m_free += p - m_head; \
 	} while(0)
 
-bool net::impl::context::try_write(int fd)
+#ifdef MP_WAVY_NET_MSG_MORE
+inline bool net::impl::context::followed_by_file(const char* p) const
+{
+	if(p >= m_tail || *(xfer_type*)p != XF_FILE) { return false; }
+	return ((xfer_file*)(p + sizeof(xfer_type)))->len > 0;
+}
+#endif
+
+inline void net::impl::context::finalize_entry(const xfer_finalize& x)
+{
+#ifdef MP_WAVY_NET_ZEROCOPY
+	if(m_zc_done < m_zc_sent) {
+		// the kernel may still read the buffers
+		defer_finalize(x);
+		return;
+	}
+#endif
+	try {
+		x.finalize(x.user);
+	} catch (...) { }
+}
+
+// Collects the iovs of consecutive XF_IOV entries from p, stepping over
+// finalizers, up to MP_WAVY_WRITEV_LIMIT. A single entry is written
+// from the queue directly. Returns the first entry not collected.
+inline char* net::impl::context::gather_iov(char* p, struct iovec* buf,
+		struct iovec** vec, size_t* veclen, size_t* total)
+{
+	size_t n = 0;
+	size_t bytes = 0;
+	char* first = NULL;
+	size_t firstlen = 0;
+
+	while(p < m_tail && n < MP_WAVY_WRITEV_LIMIT) {
+		xfer_type t = *(xfer_type*)p;
+		if(t == XF_FINALIZE) {
+			p += sizeof(xfer_type) + sizeof(xfer_finalize);
+			continue;
+		} else if(t != XF_IOV) {
+			break;
+		}
+
+		size_t len = *(size_t*)(p + sizeof(xfer_type));
+		struct iovec* v = (struct iovec*)(p + sizeof(xfer_type) + sizeof(size_t));
+		size_t take = std::min(len, MP_WAVY_WRITEV_LIMIT - n);
+
+		if(!first) {
+			first = (char*)v;
+			firstlen = take;
+		} else if(first != (char*)buf) {
+			memcpy(buf, first, sizeof(struct iovec) * firstlen);
+			first = (char*)buf;
+		}
+		if(first == (char*)buf) {
+			memcpy(buf + n, v, sizeof(struct iovec) * take);
+		}
+
+		for(size_t i=0; i < take; ++i) {
+			bytes += v[i].iov_len;
+		}
+		n += take;
+
+		if(take < len) { break; }
+		p = (char*)(v + len);
+	}
+
+	*vec = (struct iovec*)first;
+	*veclen = n;
+	*total = bytes;
+	return p;
+}
+
+// Consumes wl bytes of the XF_IOV entries from p and runs the finalizers
+// passed over. Returns the first entry not written completely.
+char* net::impl::context::consume_iov(char* p, size_t wl)
 {
+	while(p < m_tail) {
+		xfer_type t = *(xfer_type*)p;
+		if(t == XF_FINALIZE) {
+			finalize_entry(*(xfer_finalize*)(p + sizeof(xfer_type)));
+			p += sizeof(xfer_type) + sizeof(xfer_finalize);
+			continue;
+		} else if(t != XF_IOV) {
+			break;
+		}
+
+		size_t veclen = *(size_t*)(p + sizeof(xfer_type));
+		struct iovec* vec = (struct iovec*)(p + sizeof(xfer_type) + sizeof(size_t));
+
+		size_t i = 0;
+		for(; i < veclen && wl >= vec[i].iov_len; ++i) {
+			wl -= vec[i].iov_len;
+		}
+		if(i == veclen) {
+			p = (char*)(vec + veclen);
+			continue;
+		}
+
+		vec[i].iov_base = (void*)(((char*)vec[i].iov_base) + wl);
+		vec[i].iov_len -= wl;
+
+		if(i > 0) {
+			// rewrite the entry header over the written iovs
+			p = (char*)(vec + i) - sizeof(size_t) - sizeof(xfer_type);
+			*(xfer_type*)p = XF_IOV;
+			*(size_t*)(p + sizeof(xfer_type)) = veclen - i;
+		}
+		return p;
+	}
+	return p;
+}
+
+bool net::impl::context::try_write(int fd, size_t zerocopy_min)
+{
+#ifdef MP_WAVY_NET_ZEROCOPY
+	if(!m_zc_deferred.empty()) {
+		reap_completion(fd);
+		if(empty()) { return false; }
+	}
+#endif
+
+	size_t budget = MP_WAVY_NET_WRITE_BUDGET;
 	char* p = m_head;
 	while(p < m_tail) {
 		switch( *(xfer_type*)p ) {
 		case XF_IOV: {
-			size_t veclen = *(size_t*)(p + sizeof(xfer_type));
-			struct iovec* vec = (struct iovec*)(p + sizeof(xfer_type) + sizeof(size_t));
+			struct iovec buf[MP_WAVY_WRITEV_LIMIT];
+			struct iovec* vec;
+			size_t veclen;
+			size_t total;
+			char* next = gather_iov(p, buf, &vec, &veclen, &total);
+
+			int flags = 0;
+#ifdef MP_WAVY_NET_MSG_MORE
+			if(followed_by_file(next)) {
+				// hold the header back so it leaves with the file body
+				flags |= MSG_MORE;
+			}
+#endif
+#ifdef MP_WAVY_NET_ZEROCOPY
+			if(zerocopy_min > 0 && total >= zerocopy_min && enable_zerocopy(fd)) {
+				flags |= MSG_ZEROCOPY;
+			}
+#endif
 
-			ssize_t wl = ::writev(fd, vec, veclen);
-			if(wl <= 0) {
+			ssize_t wl;
+			if(flags) {
+				struct msghdr msg;
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = vec;
+				msg.msg_iovlen = veclen;
+				wl = ::sendmsg(fd, &msg, flags);
+			} else {
+				wl = ::writev(fd, vec, veclen);
+			}
+			if(wl < 0 || (wl == 0 && total > 0)) {
 				MPIO_NET_XFER_CONSUMED;
 				if(wl == 0) { return false; }
 				if(errno == EAGAIN || errno == EINTR) {
@@ -420,41 +1003,40 @@ bool net::impl::context::try_write(int fd)
 				}
 			}
 
-			for(size_t i=0; i < veclen; ++i) {
-				if(static_cast<size_t>(wl) >= vec[i].iov_len) {
-					wl -= vec[i].iov_len;
-				} else {
-					vec[i].iov_base = (void*)(((char*)vec[i].iov_base) + wl);
-					vec[i].iov_len -= wl;
-
-					if(i > 0) {
-						*(xfer_type*)m_head = XF_IOV;
-						*(size_t*)(m_head + sizeof(xfer_type)) = veclen - i;
-
-						p += sizeof(xfer_type) + sizeof(size_t) + sizeof(struct iovec)*i;
+			m_stat.bytes += wl;
+			m_bytes -= wl;
 
-						size_t trail = m_tail - p;
-						::memmove(m_head + sizeof(xfer_type), p, trail);
-						m_tail = m_head + sizeof(xfer_type) + trail;
-
-					} else {
-						MPIO_NET_XFER_CONSUMED;
-					}
+#ifdef MP_WAVY_NET_ZEROCOPY
+			if(flags & MSG_ZEROCOPY) { ++m_zc_sent; }
+#endif
 
-					return true;
-				}
+			p = consume_iov(p, wl);
+			if(static_cast<size_t>(wl) < total) {
+				MPIO_NET_XFER_CONSUMED;
+				return true;
 			}
 
-			p += sizeof(xfer_type) + sizeof(size_t) + sizeof(struct iovec) * veclen;
-
 			break; }
 
 		case XF_FILE: {
 			xfer_file* x = (xfer_file*)(p + sizeof(xfer_type));
 
+			if(x->len == 0) {
+				p += sizeof(xfer_type) + sizeof(xfer_file);
+				break;
+			}
+
+			if(budget == 0) {
+				// served enough for this round
+				MPIO_NET_XFER_CONSUMED;
+				return true;
+			}
+
+			size_t chunk = x->len < budget ? x->len : budget;
+
 #ifdef __linux__
 			off_t off = x->off;
-			ssize_t wl = ::sendfile(fd, x->fd, &off, x->len);
+			ssize_t wl = ::sendfile(fd, x->fd, &off, chunk);
 			if(wl <= 0) {
 				MPIO_NET_XFER_CONSUMED;
 				if(wl == 0) { return false; }
@@ -466,8 +1048,9 @@ bool net::impl::context::try_write(int fd)
 				}
 			}
 #else
-			off_t wl = x->size;
-			if(::sendfile(x->fd, fd, x->off, &wl, NULL, 0) < 0) {
+			off_t wl = chunk;
+			if(::sendfile(x->fd, fd, x->off, &wl, NULL, 0) < 0 && wl == 0) {
+				MPIO_NET_XFER_CONSUMED;
 				if(errno == EAGAIN || errno == EINTR) {
 					return true;
 				} else {
@@ -477,6 +1060,10 @@ bool net::impl::context::try_write(int fd)
 			}
 #endif
 
+			m_stat.bytes += wl;
+			m_bytes -= wl;
+			budget -= wl;
+
 			if(static_cast<size_t>(wl) < x->len) {
 				x->off += wl;
 				x->len -= wl;
@@ -524,19 +1111,15 @@ bool net::impl::context::try_write(int fd)
 #endif
 
 		case XF_FINALIZE:
-			try {
-				xfer_finalize* x = (xfer_finalize*)(p + sizeof(xfer_type));
-				x->finalize(x->user);
-			} catch (...) { }
-
+			finalize_entry(*(xfer_finalize*)(p + sizeof(xfer_type)));
 			p += sizeof(xfer_type) + sizeof(xfer_finalize);
-
 			break;
 		}
 	}
 
-	m_free += m_tail - m_head;
-	m_tail = m_head;
+	discard();
+
+	m_stat.active_usec += net_now_usec() - m_active_since;
 
 	return false;
 }
@@ -548,7 +1131,8 @@ void net::impl::operator() ()
 	while(true) {
 		pthread_scoped_lock lk(m_mutex);
 
-		while(m_task_queue.size() > MP_WAVY_TASK_QUEUE_LIMIT || !m_pollable) {
+		while(m_task_queue.size() > m_task_queue_limit || !m_pollable ||
+				(m_num == m_off && !m_task_queue.empty())) {
 			if(m_end_flag) { return; }
 
 			if(!m_task_queue.empty()) {
@@ -562,7 +1146,9 @@ void net::impl::operator() ()
 				goto retry;
 			}
 
+			++m_idle;
 			m_cond.wait(m_mutex);
+			--m_idle;
 		}
 
 		if(m_num == m_off) {
@@ -572,15 +1158,13 @@ void net::impl::operator() ()
 		retry_poll:
 			if(m_end_flag) { return; }
 
-			int num = m_edge.wait(&m_backlog, 1000);
+			int num = m_edge.wait(&m_backlog);
 			if(num < 0) {
 				if(errno == EINTR || errno == EAGAIN) {
 					goto retry_poll;
 				} else {
 					throw system_error(errno, "wavy net event failed");
 				}
-			} else if(num == 0) {
-				goto retry_poll;
 			}
 
 			lk.relock(m_mutex);
@@ -589,23 +1173,17 @@ void net::impl::operator() ()
 
 			m_pollable = true;
 			m_cond.signal();
+
+			// woken up by submit() or end()
+			if(num == 0) { continue; }
 		}
 
 		int fd = m_backlog[m_off];
 		++m_off;
 		lk.unlock();
 
-		{
-			bool cont;
-			try {
-				cont = m_fdctx[fd].write_event(fd);
-			} catch (...) { cont = false; }
-	
-			if(!cont) {
-				m_edge.shot_remove(fd, EVEDGE_WRITE);
-				m_fdctx[fd].reset();
-				goto retry;
-			}
+		if(!write_event(m_fdctx[fd], fd)) {
+			goto retry;
 		}
 
 		m_edge.shot_reactivate(fd, EVEDGE_WRITE);
@@ -613,42 +1191,248 @@ void net::impl::operator() ()
 }
 
 
+inline bool net::impl::write_event(context& ctx, int fd)
+{
+	pthread_scoped_lock lk(ctx.mutex());
+
+	bool cont;
+	try {
+		cont = ctx.try_write(fd, m_zerocopy_min);
+	} catch (...) { cont = false; }
+
+	if(ctx.read_paused() && (!cont || ctx.bytes() <= m_low_water)) {
+		// drained, or failed and the reader has to see the error
+		ctx.set_read_paused(false);
+		m_resume(fd);
+	}
+
+	if(!cont) {
+		write_done(ctx, fd, true);
+	}
+
+	return cont;
+}
+
+// try_write() returned false: the queue is drained or the socket failed
+inline void net::impl::write_done(context& ctx, int fd, bool registered)
+{
+#ifdef MP_WAVY_NET_ZEROCOPY
+	if(ctx.empty() && ctx.completion_waiting()) {
+		// keep the socket registered to read the error queue
+		if(registered) {
+			m_edge.shot_reactivate(fd, EVEDGE_ERROR);
+		} else {
+			m_edge.add_notify(fd, EVEDGE_ERROR);
+		}
+		return;
+	}
+#endif
+	if(registered) {
+		m_edge.shot_remove(fd, EVEDGE_WRITE);
+	}
+	ctx.reset();
+	ctx.leave_queued();
+}
+
 inline void net::impl::send_post(context& ctx, int fd, bool xempty)
 {
 	if(xempty) {
+		ctx.activate();
+
+		bool registered = false;
+#ifdef MP_WAVY_NET_ZEROCOPY
+		if(ctx.completion_waiting()) {
+			if(m_edge.shot_reactivate(fd, EVEDGE_ERROR) < 0) {
+				// the socket was closed and the descriptor reused
+				ctx.reset_completion();
+			} else {
+				registered = true;
+			}
+		}
+#endif
+
 #ifndef MP_WAVY_NO_TRY_WRITE_INITIAL
 		bool cont;
 		try {
-			cont = ctx.try_write(fd);
+			cont = ctx.try_write(fd, m_zerocopy_min);
 		} catch (...) { cont = false; }
+#else
+		bool cont = true;
+#endif
 
-		if(cont) {
-			m_edge.add_notify(fd, EVEDGE_WRITE);
+		if(!cont) {
+			write_done(ctx, fd, registered);
+			return;
+		}
+
+		if(registered) {
+			m_edge.shot_reactivate(fd, EVEDGE_WRITE);
 		} else {
-			ctx.reset();
+			m_edge.add_notify(fd, EVEDGE_WRITE);
+		}
+	}
+
+	check_high_water(ctx, fd);
+}
+
+inline void net::impl::check_high_water(context& ctx, int fd)
+{
+	// never block the sender; stop reading requests from the peer instead
+	if(!ctx.read_paused() && ctx.bytes() > m_high_water && m_pause) {
+		ctx.set_read_paused(true);
+		m_pause(fd);
+	}
+}
+
+// Locks the queue unless a direct write is running on the socket.
+// Returns true if the queue was empty.
+inline bool net::impl::lock_queue(context& ctx, pthread_scoped_lock& lk)
+{
+	while(true) {
+		lk.relock(ctx.mutex());
+		if(ctx.enter_queued()) {
+			return true;
+		}
+		if(ctx.queued()) {
+			return ctx.empty();
 		}
+		// send_direct() holds the socket for one system call or two
+		lk.unlock();
+		sched_yield();
+	}
+}
+
+// Writes on an idle socket without taking the lock or touching the
+// queue. Only what the socket doesn't accept is queued.
+// Returns false if the socket is not idle.
+bool net::impl::send_direct(context& ctx, int sock,
+		const struct iovec* vec, size_t veclen,
+		int fd, uint64_t offset, size_t count,
+		finalize_t fin, void* user)
+{
+#ifdef MP_WAVY_NO_TRY_WRITE_INITIAL
+	return false;
 #else
-		m_edge.add_notify(fd, EVEDGE_WRITE);
+	if(veclen > MP_WAVY_WRITEV_LIMIT) { return false; }
+
+	size_t total = 0;
+	for(size_t i=0; i < veclen; ++i) {
+		total += vec[i].iov_len;
+	}
+#ifdef MP_WAVY_NET_ZEROCOPY
+	if(m_zerocopy_min > 0 && total >= m_zerocopy_min) { return false; }
+#endif
+
+	if(!ctx.enter_direct()) { return false; }
+
+	bool failed = false;
+	size_t wl = 0;  // bytes of iovs written
+	size_t fl = 0;  // bytes of the file written
+
+	if(total > 0) {
+		int flags = 0;
+#ifdef MP_WAVY_NET_MSG_MORE
+		if(count > 0) { flags |= MSG_MORE; }
 #endif
-	} else {
-#ifdef MP_WAVY_WRITE_QUEUE_LIMIT
-		// FIXME sender or receiver must not wait to flush to avoid deadlock.
-		// FIXME
-		while(ctx.size() > MP_WAVY_WRITE_QUEUE_LIMIT) {
-			ctx.wait_cond();
+
+		ssize_t rl;
+		if(flags) {
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = const_cast<struct iovec*>(vec);
+			msg.msg_iovlen = veclen;
+			rl = ::sendmsg(sock, &msg, flags);
+		} else {
+			rl = ::writev(sock, vec, veclen);
+		}
+		if(rl > 0) {
+			wl = rl;
+		} else if(rl == 0 || (errno != EAGAIN && errno != EINTR)) {
+			failed = true;
 		}
+	}
+
+	if(!failed && wl == total && count > 0) {
+		size_t chunk = std::min(count, (size_t)MP_WAVY_NET_WRITE_BUDGET);
+#ifdef __linux__
+		off_t off = offset;
+		ssize_t rl = ::sendfile(sock, fd, &off, chunk);
+		if(rl > 0) {
+			fl = rl;
+		} else if(rl == 0 || (errno != EAGAIN && errno != EINTR)) {
+			failed = true;
+		}
+#else
+		off_t rl = chunk;
+		if(::sendfile(fd, sock, offset, &rl, NULL, 0) < 0 && rl == 0 &&
+				errno != EAGAIN && errno != EINTR) {
+			failed = true;
+		}
+		fl = rl;
 #endif
 	}
+
+	ctx.add_sent(wl + fl);
+
+	if(failed || (wl == total && fl == count)) {
+		if(failed) {
+			::shutdown(sock, SHUT_RD);
+		}
+		ctx.leave_direct();
+		if(fin) {
+			try {
+				fin(user);
+			} catch (...) { }
+		}
+		return true;
+	}
+
+	// queue the rest
+	pthread_scoped_lock lk(ctx.mutex());
+	try {
+		if(wl < total) {
+			size_t i = 0;
+			size_t skip = wl;
+			for(; skip >= vec[i].iov_len; ++i) {
+				skip -= vec[i].iov_len;
+			}
+			struct iovec rest = {
+				((char*)vec[i].iov_base) + skip,
+				vec[i].iov_len - skip };
+			ctx.push_iov(&rest, 1);
+			if(i + 1 < veclen) {
+				ctx.push_iov(vec + i + 1, veclen - i - 1);
+			}
+		}
+		if(fl < count) {
+			ctx.push_file(fd, offset + fl, count - fl);
+		}
+		if(fin) { ctx.push_finalize(fin, user); }
+	} catch (...) {
+		ctx.reset();
+		ctx.leave_direct();
+		::shutdown(sock, SHUT_RD);
+		throw;
+	}
+
+	ctx.activate();
+	ctx.direct_to_queued();
+	m_edge.add_notify(sock, EVEDGE_WRITE);
+	check_high_water(ctx, sock);
+	return true;
+#endif
 }
 
 
 void net::impl::send(int sock, const void* buf, size_t count)
 {
 	context& ctx(m_fdctx[sock]);
-	pthread_scoped_lock lk(ctx.mutex());
-	bool xempty = ctx.empty();
-
 	struct iovec vec = {(void*)buf, count};
+	if(send_direct(ctx, sock, &vec, 1, -1, 0, 0, NULL, NULL)) { return; }
+
+	pthread_scoped_lock lk;
+	bool xempty = lock_queue(ctx, lk);
+
 	ctx.push_iov(&vec, 1);
 	send_post(ctx, sock, xempty);
 }
@@ -660,10 +1444,12 @@ void net::impl::send(int sock, const void* buf, size_t count,
 		finalize_t fin, void* user)
 {
 	context& ctx(m_fdctx[sock]);
-	pthread_scoped_lock lk(ctx.mutex());
-	bool xempty = ctx.empty();
-
 	struct iovec vec = {(void*)buf, count};
+	if(send_direct(ctx, sock, &vec, 1, -1, 0, 0, fin, user)) { return; }
+
+	pthread_scoped_lock lk;
+	bool xempty = lock_queue(ctx, lk);
+
 	ctx.push_iov(&vec, 1);
 	if(fin) { ctx.push_finalize(fin, user); }
 	send_post(ctx, sock, xempty);
@@ -677,8 +1463,10 @@ void net::impl::send(int sock, const struct iovec* vec, size_t veclen,
 		finalize_t fin, void* user)
 {
 	context& ctx(m_fdctx[sock]);
-	pthread_scoped_lock lk(ctx.mutex());
-	bool xempty = ctx.empty();
+	if(send_direct(ctx, sock, vec, veclen, -1, 0, 0, fin, user)) { return; }
+
+	pthread_scoped_lock lk;
+	bool xempty = lock_queue(ctx, lk);
 
 	ctx.push_iov(vec, veclen);
 	if(fin) { ctx.push_finalize(fin, user); }
@@ -693,8 +1481,10 @@ void net::impl::send(int sock, int fd, uint64_t offset, size_t count,
 		finalize_t fin, void* user)
 {
 	context& ctx(m_fdctx[sock]);
-	pthread_scoped_lock lk(ctx.mutex());
-	bool xempty = ctx.empty();
+	if(send_direct(ctx, sock, NULL, 0, fd, offset, count, fin, user)) { return; }
+
+	pthread_scoped_lock lk;
+	bool xempty = lock_queue(ctx, lk);
 
 	ctx.push_file(fd, offset, count);
 	if(fin) { ctx.push_finalize(fin, user); }
@@ -711,10 +1501,12 @@ void net::impl::send(int sock,
 		finalize_t fin, void* user)
 {
 	context& ctx(m_fdctx[sock]);
-	pthread_scoped_lock lk(ctx.mutex());
-	bool xempty = ctx.empty();
-
 	struct iovec vec = {(void*)header, header_len};
+	if(send_direct(ctx, sock, &vec, 1, fd, offset, count, fin, user)) { return; }
+
+	pthread_scoped_lock lk;
+	bool xempty = lock_queue(ctx, lk);
+
 	ctx.push_iov(&vec, 1);
 	ctx.push_file(fd, offset, count);
 	if(fin) { ctx.push_finalize(fin, user); }
@@ -733,8 +1525,11 @@ void net::impl::send(int sock,
 		finalize_t fin, void* user)
 {
 	context& ctx(m_fdctx[sock]);
-	pthread_scoped_lock lk(ctx.mutex());
-	bool xempty = ctx.empty();
+	if(send_direct(ctx, sock, header_vec, header_veclen,
+				fd, offset, count, fin, user)) { return; }
+
+	pthread_scoped_lock lk;
+	bool xempty = lock_queue(ctx, lk);
 
 	ctx.push_iov(header_vec, header_veclen);
 	ctx.push_file(fd, offset, count);
@@ -752,8 +1547,8 @@ void net::send(int sock,
 void net::impl::send(int sock, xfer* xf)
 {
 	context& ctx(m_fdctx[sock]);
-	pthread_scoped_lock lk(ctx.mutex());
-	bool xempty = ctx.empty();
+	pthread_scoped_lock lk;
+	bool xempty = lock_queue(ctx, lk);
 
 	xf->migrate(&ctx);
 	send_post(ctx, sock, xempty);
@@ -762,6 +1557,25 @@ void net::send(int sock, xfer* xf)
 	{ m_impl->send(sock, xf); }
 
 
+net::send_stat net::impl::get_send_stat(int sock)
+{
+	context& ctx(m_fdctx[sock]);
+	pthread_scoped_lock lk(ctx.mutex());
+	return ctx.stat();
+}
+net::send_stat net::get_send_stat(int sock)
+	{ return m_impl->get_send_stat(sock); }
+
+void net::impl::reset_send_stat(int sock)
+{
+	context& ctx(m_fdctx[sock]);
+	pthread_scoped_lock lk(ctx.mutex());
+	ctx.reset_stat();
+}
+void net::reset_send_stat(int sock)
+	{ m_impl->reset_send_stat(sock); }
+
+
 }  // namespace wavy
 }  // namespace mp
 